@@ -0,0 +1,559 @@
+/*
+    xroach_bench - step the roach simulation without an X server.
+
+    Runs the simulation core for a fixed number of ticks at several
+    population sizes and reports the cost per roach per tick together with
+    the allocations made by the simulation, so regressions in the hot loop
+    show up without a display.  With -collide, every size is also run with
+    grid based collision avoidance, and small sizes with the brute force
+    version for comparison.  Collision cost depends on how crowded the
+    screen is, so those runs grow the screen with the population to keep
+    the number of roaches per pixel that of 10000 roaches on the base
+    screen.  With -squish, each run ends with a series of clicks at random
+    spots, timed the way checkSquish in xroach resolves them.
+
+    With -threads N, the plain runs are repeated with 1, 2, 4 and so on up
+    to N threads.  Every run starts from the same seed, and the checksum
+    of the final roach state shows that the thread count makes no
+    difference to where the roaches end up.  -seed picks another seed.
+    With -expect, any run whose checksum differs from the given one
+    fails, which is how the tests pin the simulation down.
+
+    With -cover, each size is run twice more with a window over the middle
+    of the screen, once heading for it and once wandering the old way, and
+    the share of roaches that found cover is reported.
+
+    With -churn N, each size is also grown by breeding from a couple of
+    roaches, and then run with N roaches dying and N born every tick, to
+    show that neither costs more than a constant or allocates.
+
+    With -frame, every size is also run drawing into an in-memory bitmap
+    the way xroach draws on the root window, to time whole frames.  The
+    image column is a checksum of the last frame, and -dump writes it out
+    as a PBM image.  With -expect-frame, a frame run whose image checksum
+    differs from the given one fails too.
+
+    To run:
+      ./xroach_bench -ticks 200 -roaches 50000
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "roach.h"
+#include "framebuf.h"
+
+/* Brute force collision avoidance is quadratic; keep it to small runs. */
+#define BRUTE_ROACHES 20000
+#define BRUTE_TICKS   10
+#define BASE_ROACHES  10000
+#define SQUISH_CLICKS 1000
+#define SQUISH_HITS   64
+
+static int benchCounts[] = {10000, 100000, 1000000};
+
+static char *collideNames[] = {"none", "grid", "brute"};
+
+static int squish = 0;
+static int cover = 0;
+static int churn = 0;
+static int threads = 1;
+static uint64_t seed = 1;
+static int frameBench = 0;
+static int drawFrame = 0;
+static char *dumpFile = NULL;
+static int expect = 0;
+static uint32_t expectSum;
+static int expectFrame = 0;
+static uint32_t expectFrameSum;
+
+void Usage();
+double Now();
+void RunBench(int count, int ticks);
+void RunCollideBench(int count, int ticks);
+void RunSquishBench();
+void RunCoverBench(int count, int ticks);
+void RunChurnBench(int count, int ticks);
+
+int main(int ac, char *av[])
+{
+    char *arg;
+    int  collide = 0;
+    int  count   = 0;
+    int  ticks   = 100;
+
+    for (int ax = 1; ax < ac; ax++)
+    {
+        arg = av[ax];
+
+        if (strcmp(arg, "-collide") == 0)
+            collide = 1;
+        else if (strcmp(arg, "-squish") == 0)
+            squish = 1;
+        else if (strcmp(arg, "-cover") == 0)
+            cover = 1;
+        else if (strcmp(arg, "-frame") == 0)
+            frameBench = 1;
+        else if (ax + 1 >= ac)
+            Usage();
+        else if (strcmp(arg, "-threads") == 0)
+            threads = (int) strtol(av[++ax], (char **) NULL, 0);
+        else if (strcmp(arg, "-churn") == 0)
+            churn = (int) strtol(av[++ax], (char **) NULL, 0);
+        else if (strcmp(arg, "-dump") == 0)
+            dumpFile = av[++ax];
+        else if (strcmp(arg, "-expect") == 0)
+        {
+            expectSum = (uint32_t) strtoul(av[++ax], (char **) NULL, 16);
+            expect = 1;
+        }
+        else if (strcmp(arg, "-expect-frame") == 0)
+        {
+            expectFrameSum = (uint32_t) strtoul(av[++ax], (char **) NULL, 16);
+            expectFrame = 1;
+        }
+        else if (strcmp(arg, "-seed") == 0)
+            seed = (uint64_t) strtoull(av[++ax], (char **) NULL, 0);
+        else if (strcmp(arg, "-ticks") == 0)
+            ticks = (int) strtol(av[++ax], (char **) NULL, 0);
+        else if (strcmp(arg, "-roaches") == 0)
+            count = (int) strtol(av[++ax], (char **) NULL, 0);
+        else if (strcmp(arg, "-speed") == 0)
+            roachSpeed = (float) strtod(av[++ax], (char **) NULL);
+        else if (strcmp(arg, "-width") == 0)
+            display_width = (unsigned int) strtoul(av[++ax], (char **) NULL, 0);
+        else if (strcmp(arg, "-height") == 0)
+            display_height = (unsigned int) strtoul(av[++ax], (char **) NULL, 0);
+        else
+            Usage();
+    }
+
+    if (display_width == 0)
+        display_width = 1920;
+
+    if (display_height == 0)
+        display_height = 1080;
+
+    if (ticks < 1 || roachSpeed <= 0 || threads < 1 || churn < 0)
+        Usage();
+
+    printf("%10s %8s %6s %7s %11s %8s %14s %10s %12s %12s %12s %9s %9s\n",
+           "roaches", "collide", "draw", "threads", "screen", "ticks", "ns/roach/tick", "Mroach/s",
+           "setup bytes", "tick allocs", "tick bytes", "checksum", "image");
+
+    for (int bx = 0; bx < (int) (sizeof(benchCounts) / sizeof(benchCounts[0])); bx++)
+    {
+        if (count > 0)
+        {
+            if (bx > 0)
+                break;
+
+            benchCounts[bx] = count;
+        }
+
+        collisionMode = COLLIDE_NONE;
+
+        for (roachThreads = 1; roachThreads < threads; roachThreads *= 2)
+            RunBench(benchCounts[bx], ticks);
+
+        roachThreads = threads;
+        RunBench(benchCounts[bx], ticks);
+
+        if (frameBench)
+        {
+            drawFrame = 1;
+            RunBench(benchCounts[bx], ticks);
+            drawFrame = 0;
+        }
+
+        if (collide)
+            RunCollideBench(benchCounts[bx], ticks);
+
+        if (cover)
+            RunCoverBench(benchCounts[bx], ticks);
+
+        if (churn > 0)
+            RunChurnBench(benchCounts[bx], ticks);
+    }
+
+    return 0;
+}
+
+void Usage()
+{
+    fprintf(stderr, "Usage: xroach_bench [options]\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "       -roaches numroaches  (default: 10000, 100000 and 1000000)\n");
+    fprintf(stderr, "       -ticks   numticks\n");
+    fprintf(stderr, "       -collide\n");
+    fprintf(stderr, "       -squish\n");
+    fprintf(stderr, "       -cover\n");
+    fprintf(stderr, "       -churn   roachespertick\n");
+    fprintf(stderr, "       -threads numthreads\n");
+    fprintf(stderr, "       -seed    seed  (default: 1)\n");
+    fprintf(stderr, "       -expect  checksum\n");
+    fprintf(stderr, "       -expect-frame imagechecksum\n");
+    fprintf(stderr, "       -frame\n");
+    fprintf(stderr, "       -dump    pbmfile\n");
+    fprintf(stderr, "       -speed   roachspeed\n");
+    fprintf(stderr, "       -width   screenwidth\n");
+    fprintf(stderr, "       -height  screenheight\n");
+
+    exit(1);
+}
+
+/*
+   Monotonic time in nanoseconds.
+*/
+double Now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+   Step count roaches for the given number of ticks.  Settling every roach
+   after its move stands in for DrawRoaches, which does the same, unless
+   this is the -frame run, which draws them into the in-memory frame.  Any
+   allocation made inside the tick loop is reported separately from the
+   setup, since the hot loop should not allocate at all.
+*/
+void RunBench(int count, int ticks)
+{
+    double elapsed;
+    double start;
+    long   allocs;
+    size_t allocBytes;
+    size_t setupBytes;
+    char   image[16];
+
+    SeedRoaches(seed);
+    setupBytes = roachAllocBytes;
+    maxRoaches = count;
+
+    if (!InitRoaches() || !AddRoaches(count))
+    {
+        fprintf(stderr, "xroach_bench: cannot allocate %d roaches\n", count);
+        exit(1);
+    }
+
+    if (drawFrame && !InitFrameBuffer())
+    {
+        fprintf(stderr, "xroach_bench: cannot set up a %ux%u frame\n", display_width, display_height);
+        exit(1);
+    }
+
+    setupBytes = roachAllocBytes - setupBytes;
+    allocs = roachAllocs;
+    allocBytes = roachAllocBytes;
+    start = Now();
+
+    for (int tx = 0; tx < ticks; tx++)
+    {
+        MoveRoaches();
+
+        if (drawFrame)
+        {
+            DrawRoachesFrame();
+            continue;
+        }
+
+        for (int rx = 0; rx < activeRoaches; rx++)
+            SettleRoach(rx);
+    }
+
+    elapsed = Now() - start;
+
+    if (drawFrame)
+        snprintf(image, sizeof(image), "%08x", FrameChecksum());
+    else
+        snprintf(image, sizeof(image), "-");
+
+    printf("%10d %8s %6s %7d %5ux%-5u %8d %14.2f %10.1f %12zu %12ld %12zu %9.8x %9s\n",
+           count,
+           collideNames[collisionMode],
+           drawFrame ? "frame" : "settle",
+           roachThreads,
+           display_width,
+           display_height,
+           ticks,
+           elapsed / ((double) count * ticks),
+           (double) count * ticks * 1e3 / elapsed,
+           setupBytes,
+           roachAllocs - allocs,
+           roachAllocBytes - allocBytes,
+           RoachChecksum(),
+           image);
+
+    if (expect && RoachChecksum() != expectSum)
+    {
+        fprintf(stderr, "xroach_bench: checksum %08x, expected %08x\n", RoachChecksum(), expectSum);
+        exit(1);
+    }
+
+    if (drawFrame && expectFrame && FrameChecksum() != expectFrameSum)
+    {
+        fprintf(stderr, "xroach_bench: image checksum %08x, expected %08x\n", FrameChecksum(), expectFrameSum);
+        exit(1);
+    }
+
+    if (drawFrame)
+    {
+        if (dumpFile != NULL && !WriteFramePBM(dumpFile))
+            perror(dumpFile);
+
+        FreeFrameBuffer();
+    }
+
+    if (squish)
+        RunSquishBench();
+
+    FreeRoaches();
+}
+
+/*
+   Run count roaches with grid and, if there are few enough, brute force
+   collision avoidance, on a screen scaled to keep the crowding constant.
+*/
+void RunCollideBench(int count, int ticks)
+{
+    double       scale;
+    unsigned int baseHeight;
+    unsigned int baseWidth;
+
+    baseWidth = display_width;
+    baseHeight = display_height;
+    scale = count > BASE_ROACHES ? sqrt((double) count / BASE_ROACHES) : 1.0;
+    display_width = (unsigned int) (baseWidth * scale);
+    display_height = (unsigned int) (baseHeight * scale);
+
+    collisionMode = COLLIDE_GRID;
+    RunBench(count, ticks);
+
+    if (count <= BRUTE_ROACHES)
+    {
+        collisionMode = COLLIDE_BRUTE;
+        RunBench(count, ticks < BRUTE_TICKS ? ticks : BRUTE_TICKS);
+    }
+
+    collisionMode = COLLIDE_NONE;
+    display_width = baseWidth;
+    display_height = baseHeight;
+}
+
+/*
+   Click SQUISH_CLICKS times at random spots and squish whatever is there,
+   reporting the time per click.  The first click pays for building the
+   index; removals patch it, so the rest do not.
+*/
+void RunSquishBench()
+{
+    double elapsed;
+    double start;
+    int    hits[SQUISH_HITS];
+    int    nHits;
+    int    squished;
+    int    x;
+    int    y;
+
+    squished = 0;
+    start = Now();
+
+    for (int cx = 0; cx < SQUISH_CLICKS; cx++)
+    {
+        x = RandInt((int) display_width);
+        y = RandInt((int) display_height);
+
+        do
+        {
+            nHits = RoachesAt(x, y, 0, hits, SQUISH_HITS);
+
+            for (int hx = 0; hx < nHits; hx++)
+                RemoveRoach(hits[hx]);
+
+            squished += nHits;
+        } while (nHits == SQUISH_HITS);
+    }
+
+    elapsed = Now() - start;
+
+    printf("%10s %d clicks, %.2f us/click, %d squished\n",
+           "",
+           SQUISH_CLICKS,
+           elapsed / (SQUISH_CLICKS * 1e3),
+           squished);
+}
+
+/*
+   Put a window over the middle ninth of the screen and step count roaches
+   for the given number of ticks, hiding the ones that end up entirely
+   under it the way MarkHiddenRoaches would.  Done with and without the
+   cover field; reports the share hidden at the end of each, and then how
+   long the hidden roaches take to wake up once the window is gone.
+*/
+void RunCoverBench(int count, int ticks)
+{
+    int    x1, y1, x2, y2;
+    int    hidden[2];
+    int    revealTicks = 0;
+    double elapsed[2];
+    double start;
+    double tick;
+    double worst = 0;
+
+    x1 = (int) display_width / 3;
+    y1 = (int) display_height / 3;
+    x2 = (int) display_width * 2 / 3;
+    y2 = (int) display_height * 2 / 3;
+
+    for (int seek = 0; seek < 2; seek++)
+    {
+        SeedRoaches(seed);
+        maxRoaches = count;
+        coverSeeking = seek;
+
+        if (!InitRoaches() || !AddRoaches(count))
+        {
+            fprintf(stderr, "xroach_bench: cannot allocate %d roaches\n", count);
+            exit(1);
+        }
+
+        for (int cy = 0; cy < coverRows; cy++)
+            for (int cx = 0; cx < coverCols; cx++)
+                coverCells[cy * coverCols + cx] = (cx << COVER_SHIFT) >= x1 && ((cx + 1) << COVER_SHIFT) <= x2 &&
+                                                  (cy << COVER_SHIFT) >= y1 && ((cy + 1) << COVER_SHIFT) <= y2;
+
+        start = Now();
+        BuildCoverField();
+
+        for (int tx = 0; tx < ticks; tx++)
+        {
+            MoveRoaches();
+
+            for (int rx = 0; rx < activeRoaches; rx++)
+            {
+                SettleRoach(rx);
+
+                if (roaches.intX[rx] >= x1 && roaches.intX[rx] + headingWidth[roaches.drawn[rx]] <= x2 &&
+                    roaches.intY[rx] >= y1 && roaches.intY[rx] + headingHeight[roaches.drawn[rx]] <= y2)
+                    roaches.flags[rx] |= ROACH_HIDDEN;
+            }
+
+            HideRoaches();
+        }
+
+        elapsed[seek] = Now() - start;
+        hidden[seek] = curRoaches - activeRoaches;
+
+        /* Take the cover away, and see how long the hidden roaches take to come out. */
+        if (seek)
+        {
+            ShowRoaches();
+
+            while (activeRoaches < curRoaches)
+            {
+                start = Now();
+                MoveRoaches();
+
+                for (int rx = 0; rx < activeRoaches; rx++)
+                    SettleRoach(rx);
+
+                tick = Now() - start;
+                worst = tick > worst ? tick : worst;
+                revealTicks++;
+            }
+        }
+
+        FreeRoaches();
+    }
+
+    coverSeeking = 1;
+
+    printf("%10s cover after %d ticks: %.1f%% hidden heading for it (%.2f ns/roach/tick), "
+           "%.1f%% wandering (%.2f ns/roach/tick)\n",
+           "",
+           ticks,
+           hidden[1] * 100.0 / count,
+           elapsed[1] / ((double) count * ticks),
+           hidden[0] * 100.0 / count,
+           elapsed[0] / ((double) count * ticks));
+    printf("%10s reveal of %d roaches: %d ticks, %.3f ms worst tick\n",
+           "", hidden[1], revealTicks, worst / 1e6);
+}
+
+/*
+   Breed count roaches from SPAWN_START, then step them for the given
+   number of ticks with churn of them squished and as many born every
+   tick.  The pool grows a chunk at a time while breeding, and not at all
+   after that.
+*/
+void RunChurnBench(int count, int ticks)
+{
+    double elapsed;
+    double grow;
+    double start;
+    long   allocs;
+    long   growAllocs;
+
+    SeedRoaches(seed);
+    maxRoaches = count;
+
+    if (!InitRoaches() || !AddRoaches(SPAWN_START))
+    {
+        fprintf(stderr, "xroach_bench: cannot allocate %d roaches\n", count);
+        exit(1);
+    }
+
+    allocs = roachAllocs;
+    start = Now();
+
+    while (curRoaches < count)
+    {
+        if (!BreedRoach())
+        {
+            fprintf(stderr, "xroach_bench: cannot breed %d roaches\n", count);
+            exit(1);
+        }
+    }
+
+    grow = Now() - start;
+    growAllocs = roachAllocs - allocs;
+    allocs = roachAllocs;
+    start = Now();
+
+    for (int tx = 0; tx < ticks; tx++)
+    {
+        for (int cx = 0; cx < churn && cx < count; cx++)
+        {
+            RemoveRoach(RandInt(curRoaches));
+            BreedRoach();
+        }
+
+        MoveRoaches();
+
+        for (int rx = 0; rx < activeRoaches; rx++)
+            SettleRoach(rx);
+    }
+
+    elapsed = Now() - start;
+
+    printf("%10s bred %d in %.2f ms with %ld pool growths, then %d died and were born a tick: "
+           "%.2f ns/roach/tick, %ld tick allocs\n",
+           "",
+           count,
+           grow / 1e6,
+           growAllocs,
+           churn,
+           elapsed / ((double) count * ticks),
+           roachAllocs - allocs);
+
+    FreeRoaches();
+}
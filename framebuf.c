@@ -0,0 +1,211 @@
+/*
+    In-memory 1-bit framebuffer for xroach_bench.
+
+    Copyright 1991 by J.T. Anderson
+
+    jta@locus.com
+
+    This program may be freely distributed provided that all
+    copyright notices are retained.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "roach.h"
+#include "framebuf.h"
+
+/*
+   A sprite row is read and written as two neighbouring 64 bit words; with
+   SSE2 both go in one unaligned 128 bit access.
+*/
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define SPRITE_MAX 64    /* sprites must fit in one word per row */
+
+/*
+   Pixel x of row y is bit x % 64 of word y * frameWords + x / 64, so the
+   bit order matches the XBM data.  Every row has a spare word at its end
+   for sprites that straddle the last word.
+*/
+static uint64_t *frame      = NULL;
+static int      frameWords  = 0;
+
+static uint64_t spriteRows[ROACH_HEADINGS][SPRITE_MAX];
+
+/*
+   Set up a blank frame the size of the screen and turn the sprites into
+   one word per row.  Returns 0 on failure.
+*/
+int InitFrameBuffer()
+{
+    RoachMap *rp;
+    int      rowBytes;
+
+    for (int hx = 0; hx < ROACH_HEADINGS; hx++)
+    {
+        rp = &roachPix[hx];
+
+        if (rp->width > SPRITE_MAX || rp->height > SPRITE_MAX)
+            return 0;
+
+        rowBytes = (rp->width + 7) / 8;
+
+        for (int y = 0; y < rp->height; y++)
+        {
+            spriteRows[hx][y] = 0;
+
+            for (int bx = 0; bx < rowBytes; bx++)
+                spriteRows[hx][y] |= (uint64_t) (unsigned char) rp->roachBits[y * rowBytes + bx] << (bx * 8);
+        }
+    }
+
+    frameWords = (int) (display_width + 63) / 64 + 1;
+
+    if (posix_memalign((void **) &frame, ROACH_ALIGN, sizeof(uint64_t) * frameWords * display_height) != 0)
+    {
+        frame = NULL;
+        return 0;
+    }
+
+    memset(frame, 0, sizeof(uint64_t) * frameWords * display_height);
+
+    return 1;
+}
+
+void FreeFrameBuffer()
+{
+    free(frame);
+    frame = NULL;
+}
+
+/*
+   Clear the pixels of mask, shifted to column x, in height rows from row
+   y, and then set those of bits, a row at a time.  Erasing passes a full
+   mask and no bits, drawing no mask and the sprite.
+*/
+static void BlitRows(int x, int y, int height, uint64_t mask, const uint64_t *bits)
+{
+    uint64_t *row;
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t clearLo;
+    uint64_t clearHi;
+    int      shift;
+
+    shift = x & 63;
+    row = frame + (size_t) y * frameWords + (x >> 6);
+    clearLo = ~(mask << shift);
+    clearHi = shift ? ~(mask >> (64 - shift)) : ~(uint64_t) 0;
+
+    for (int ry = 0; ry < height; ry++, row += frameWords)
+    {
+        lo = bits ? bits[ry] << shift : 0;
+        hi = bits && shift ? bits[ry] >> (64 - shift) : 0;
+
+#if defined(__SSE2__)
+        _mm_storeu_si128((__m128i *) row,
+                         _mm_or_si128(_mm_and_si128(_mm_loadu_si128((__m128i *) row),
+                                                    _mm_set_epi64x((long long) clearHi, (long long) clearLo)),
+                                      _mm_set_epi64x((long long) hi, (long long) lo)));
+#else
+        row[0] = (row[0] & clearLo) | lo;
+        row[1] = (row[1] & clearHi) | hi;
+#endif
+    }
+}
+
+/*
+   Draw all roaches into the frame, as DrawRoaches does on the root: each
+   visible roach is erased where it was last drawn, settled, and stippled
+   at its new spot.
+*/
+void DrawRoachesFrame()
+{
+    int hx;
+    int width;
+
+    for (int rx = 0; rx < activeRoaches; rx++)
+    {
+        if (roaches.flags[rx] & ROACH_HIDDEN)
+        {
+            roaches.intX[rx] = -1;
+            continue;
+        }
+
+        if (roaches.intX[rx] >= 0)
+        {
+            width = headingWidth[roaches.drawn[rx]];
+            BlitRows(roaches.intX[rx], roaches.intY[rx], headingHeight[roaches.drawn[rx]],
+                     width < 64 ? ((uint64_t) 1 << width) - 1 : ~(uint64_t) 0, NULL);
+        }
+
+        SettleRoach(rx);
+        hx = roaches.drawn[rx];
+        BlitRows(roaches.intX[rx], roaches.intY[rx], headingHeight[hx], 0, spriteRows[hx]);
+    }
+}
+
+/*
+   FNV-1a hash of the visible part of the frame.
+*/
+uint32_t FrameChecksum()
+{
+    uint32_t hash = 2166136261u;
+    uint64_t word;
+
+    for (unsigned int y = 0; y < display_height; y++)
+    {
+        for (int wx = 0; wx < frameWords - 1; wx++)
+        {
+            word = frame[(size_t) y * frameWords + wx];
+
+            if (wx == frameWords - 2 && display_width % 64)
+                word &= ((uint64_t) 1 << (display_width % 64)) - 1;
+
+            for (int bx = 0; bx < 8; bx++)
+                hash = (hash ^ (unsigned char) (word >> (bx * 8))) * 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+/*
+   Write the frame to path as a binary PBM image, black roaches on white.
+   Returns 0 on failure.
+*/
+int WriteFramePBM(const char *path)
+{
+    FILE          *out;
+    unsigned char byte;
+
+    out = fopen(path, "wb");
+
+    if (out == NULL)
+        return 0;
+
+    fprintf(out, "P4\n%u %u\n", display_width, display_height);
+
+    for (unsigned int y = 0; y < display_height; y++)
+    {
+        for (unsigned int x = 0; x < display_width; x += 8)
+        {
+            byte = 0;
+
+            /* PBM packs the leftmost pixel into the top bit. */
+            for (unsigned int bx = 0; bx < 8 && x + bx < display_width; bx++)
+                if ((frame[(size_t) y * frameWords + ((x + bx) >> 6)] >> ((x + bx) & 63)) & 1)
+                    byte |= (unsigned char) (0x80 >> bx);
+
+            putc(byte, out);
+        }
+    }
+
+    return fclose(out) == 0;
+}
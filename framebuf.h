@@ -0,0 +1,22 @@
+/*
+    In-memory 1-bit framebuffer for xroach_bench.
+
+    Draws the roaches the way DrawRoaches does on the root window, erasing
+    each visible roach where it was and stippling it where it is now, but
+    into a bitmap in memory.  That times the whole frame without a display,
+    and the bitmap can be checksummed or written out as a PBM image to
+    compare against a known good frame.
+*/
+
+#ifndef FRAMEBUF_H
+#define FRAMEBUF_H
+
+#include <stdint.h>
+
+int InitFrameBuffer();
+void FreeFrameBuffer();
+void DrawRoachesFrame();
+uint32_t FrameChecksum();
+int WriteFramePBM(const char *path);
+
+#endif /* FRAMEBUF_H */
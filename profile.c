@@ -0,0 +1,437 @@
+/*
+    X protocol traffic profile of xroach.
+
+    Copyright 1991 by J.T. Anderson
+
+    jta@locus.com
+
+    This program may be freely distributed provided that all
+    copyright notices are retained.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlibint.h>
+
+#include "profile.h"
+
+#define PROFILE_MARKS  256    /* part changes waiting for their requests to be flushed */
+#define PROFILE_EXTS   8      /* extensions looked up by name */
+
+typedef struct PartCounts
+{
+    unsigned long requests;
+    unsigned long bytes;
+    unsigned long roundTrips;
+    unsigned long flushes;
+} PartCounts;
+
+/*
+   A part change: requests from sequence number seq on belong to part.
+*/
+typedef struct PartMark
+{
+    unsigned long seq;
+    int           part;
+} PartMark;
+
+static const char *partNames[PROFILE_PARTS] = {"other", "draw", "calc", "squish", "sync"};
+
+/*
+   Names of the core requests, and which of them wait for a reply.  Of
+   the extension requests only the major opcode is known here; the ones
+   xroach sends per frame never have replies.
+*/
+static const char *requestNames[128] = {
+    NULL, "CreateWindow", "ChangeWindowAttributes", "GetWindowAttributes",
+    "DestroyWindow", "DestroySubwindows", "ChangeSaveSet", "ReparentWindow",
+    "MapWindow", "MapSubwindows", "UnmapWindow", "UnmapSubwindows",
+    "ConfigureWindow", "CirculateWindow", "GetGeometry", "QueryTree",
+    "InternAtom", "GetAtomName", "ChangeProperty", "DeleteProperty",
+    "GetProperty", "ListProperties", "SetSelectionOwner", "GetSelectionOwner",
+    "ConvertSelection", "SendEvent", "GrabPointer", "UngrabPointer",
+    "GrabButton", "UngrabButton", "ChangeActivePointerGrab", "GrabKeyboard",
+    "UngrabKeyboard", "GrabKey", "UngrabKey", "AllowEvents",
+    "GrabServer", "UngrabServer", "QueryPointer", "GetMotionEvents",
+    "TranslateCoords", "WarpPointer", "SetInputFocus", "GetInputFocus",
+    "QueryKeymap", "OpenFont", "CloseFont", "QueryFont",
+    "QueryTextExtents", "ListFonts", "ListFontsWithInfo", "SetFontPath",
+    "GetFontPath", "CreatePixmap", "FreePixmap", "CreateGC",
+    "ChangeGC", "CopyGC", "SetDashes", "SetClipRectangles",
+    "FreeGC", "ClearArea", "CopyArea", "CopyPlane",
+    "PolyPoint", "PolyLine", "PolySegment", "PolyRectangle",
+    "PolyArc", "FillPoly", "PolyFillRectangle", "PolyFillArc",
+    "PutImage", "GetImage", "PolyText8", "PolyText16",
+    "ImageText8", "ImageText16", "CreateColormap", "FreeColormap",
+    "CopyColormapAndFree", "InstallColormap", "UninstallColormap", "ListInstalledColormaps",
+    "AllocColor", "AllocNamedColor", "AllocColorCells", "AllocColorPlanes",
+    "FreeColors", "StoreColors", "StoreNamedColor", "QueryColors",
+    "LookupColor", "CreateCursor", "CreateGlyphCursor", "FreeCursor",
+    "RecolorCursor", "QueryBestSize", "QueryExtension", "ListExtensions",
+    "ChangeKeyboardMapping", "GetKeyboardMapping", "ChangeKeyboardControl", "GetKeyboardControl",
+    "Bell", "ChangePointerControl", "GetPointerControl", "SetScreenSaver",
+    "GetScreenSaver", "ChangeHosts", "ListHosts", "SetAccessControl",
+    "SetCloseDownMode", "KillClient", "RotateProperties", "ForceScreenSaver",
+    "SetPointerMapping", "GetPointerMapping", "SetModifierMapping", "GetModifierMapping",
+    [127] = "NoOperation"
+};
+
+static const unsigned char hasReply[128] = {
+    [X_GetWindowAttributes] = 1, [X_GetGeometry] = 1, [X_QueryTree] = 1,
+    [X_InternAtom] = 1, [X_GetAtomName] = 1, [X_GetProperty] = 1,
+    [X_ListProperties] = 1, [X_GetSelectionOwner] = 1, [X_GrabPointer] = 1,
+    [X_GrabKeyboard] = 1, [X_QueryPointer] = 1, [X_GetMotionEvents] = 1,
+    [X_TranslateCoords] = 1, [X_GetInputFocus] = 1, [X_QueryKeymap] = 1,
+    [X_QueryFont] = 1, [X_QueryTextExtents] = 1, [X_ListFonts] = 1,
+    [X_ListFontsWithInfo] = 1, [X_GetFontPath] = 1, [X_GetImage] = 1,
+    [X_ListInstalledColormaps] = 1, [X_AllocColor] = 1, [X_AllocNamedColor] = 1,
+    [X_AllocColorCells] = 1, [X_AllocColorPlanes] = 1, [X_QueryColors] = 1,
+    [X_LookupColor] = 1, [X_QueryBestSize] = 1, [X_QueryExtension] = 1,
+    [X_ListExtensions] = 1, [X_GetKeyboardMapping] = 1, [X_GetKeyboardControl] = 1,
+    [X_GetPointerControl] = 1, [X_GetScreenSaver] = 1, [X_ListHosts] = 1,
+    [X_SetPointerMapping] = 1, [X_GetPointerMapping] = 1, [X_SetModifierMapping] = 1,
+    [X_GetModifierMapping] = 1
+};
+
+/* Extensions xroach may use, to name their major opcodes. */
+static const char *extNames[PROFILE_EXTS] = {
+    "RENDER", "MIT-SHM", "BIG-REQUESTS", "XC-MISC", "XFIXES", "SHAPE", "Generic Event Extension", NULL
+};
+static int extOpcodes[PROFILE_EXTS];
+
+static Display *profileDisplay = NULL;
+static FILE    *profileFile = NULL;
+static long    profileFrames = 0;
+static int     curPart = PROFILE_OTHER;
+static int     seqPart = PROFILE_OTHER;
+
+static PartCounts    totals[PROFILE_PARTS];
+static PartCounts    frameCounts[PROFILE_PARTS];
+static unsigned long opRequests[PROFILE_PARTS][256];
+static unsigned long opBytes[PROFILE_PARTS][256];
+
+static PartMark marks[PROFILE_MARKS];
+static int      markHead = 0;
+static int      markCount = 0;
+
+/*
+   Where the parse of the output stream is: the sequence number of the
+   last request seen, and how much of the last request is still to come.
+   A request header split over two writes is kept in head until it is
+   whole.
+*/
+static unsigned long parsedSeq;
+static unsigned long skipBytes = 0;
+static unsigned char head[8];
+static int           headLen = 0;
+
+/*
+   Add to the counters of part, for the run and for the current frame.
+*/
+static void CountPart(int part, int opcode, unsigned long requests, unsigned long bytes,
+                      unsigned long roundTrips, unsigned long flushes)
+{
+    totals[part].requests += requests;
+    totals[part].bytes += bytes;
+    totals[part].roundTrips += roundTrips;
+    totals[part].flushes += flushes;
+    frameCounts[part].requests += requests;
+    frameCounts[part].bytes += bytes;
+    frameCounts[part].roundTrips += roundTrips;
+    frameCounts[part].flushes += flushes;
+
+    if (opcode >= 0)
+    {
+        opRequests[part][opcode] += requests;
+        opBytes[part][opcode] += bytes;
+    }
+}
+
+/*
+   Part the request with sequence number seq belongs to.  The marks are
+   used up in order, since the requests are flushed in order.
+*/
+static int PartOf(unsigned long seq)
+{
+    while (markCount > 0 && marks[markHead].seq <= seq)
+    {
+        seqPart = marks[markHead].part;
+        markHead = (markHead + 1) % PROFILE_MARKS;
+        markCount--;
+    }
+
+    return seqPart;
+}
+
+/*
+   Count a request from its header, and return its length in bytes.
+*/
+static unsigned long CountRequest(Display *dpy, const unsigned char *header)
+{
+    uint16_t      shortLen;
+    uint32_t      longLen;
+    unsigned long len;
+    int           part;
+
+    memcpy(&shortLen, header + 2, sizeof(shortLen));
+    len = (unsigned long) shortLen * 4;
+
+    if (shortLen == 0 && dpy->bigreq_size != 0)
+    {
+        memcpy(&longLen, header + 4, sizeof(longLen));
+        len = (unsigned long) longLen * 4;
+    }
+
+    /* Never get stuck on a bad length. */
+    if (len < 4)
+        len = 4;
+
+    part = PartOf(++parsedSeq);
+    CountPart(part, header[0], 1, len, header[0] < 128 && hasReply[header[0]], 0);
+
+    return len;
+}
+
+/*
+   Called by Xlib with every piece of data it is about to write: first
+   the output buffer, then any data that did not fit in it.  Requests are
+   picked out of the stream by their headers, and each write of the
+   buffer is a flush.
+*/
+static void BeforeFlush(Display *dpy, XExtCodes *codes, const char *data, long len)
+{
+    const unsigned char *bytes;
+    unsigned long       reqLen;
+    unsigned long       taken;
+    int                 need;
+
+    (void) codes;
+    bytes = (const unsigned char *) data;
+
+    if (data == dpy->buffer && len > 0)
+        CountPart(curPart, -1, 0, 0, 0, 1);
+
+    while (len > 0)
+    {
+        if (skipBytes > 0)
+        {
+            taken = skipBytes < (unsigned long) len ? skipBytes : (unsigned long) len;
+            skipBytes -= taken;
+            bytes += taken;
+            len -= (long) taken;
+            continue;
+        }
+
+        /* Gather a whole header, 8 bytes if it is a big request. */
+        need = 4;
+
+        while (headLen < need && len > 0)
+        {
+            head[headLen++] = *bytes++;
+            len--;
+
+            if (headLen == 4 && (head[2] | head[3]) == 0 && dpy->bigreq_size != 0)
+                need = 8;
+        }
+
+        if (headLen < need)
+            break;
+
+        reqLen = CountRequest(dpy, head);
+        skipBytes = reqLen > (unsigned long) headLen ? reqLen - (unsigned long) headLen : 0;
+        headLen = 0;
+    }
+
+    /* Xlib has numbered every request in the buffer by now; stay in step. */
+    if (data == dpy->buffer && headLen == 0)
+        parsedSeq = dpy->request;
+}
+
+/*
+   Start profiling the requests sent on display, writing a line per frame
+   to the CSV file at path.
+*/
+int StartProfile(Display *display, const char *path)
+{
+    XExtCodes *codes;
+    int       event;
+    int       error;
+
+    profileFile = fopen(path, "w");
+
+    if (profileFile == NULL)
+        return 0;
+
+    fprintf(profileFile, "frame,frame_ms");
+
+    for (int px = 0; px < PROFILE_PARTS; px++)
+        fprintf(profileFile, ",%s_requests,%s_bytes,%s_round_trips,%s_flushes",
+                partNames[px], partNames[px], partNames[px], partNames[px]);
+
+    fprintf(profileFile, "\n");
+
+    /* Look the extensions up before counting starts; these are not counted. */
+    for (int ex = 0; extNames[ex] != NULL; ex++)
+        if (!XQueryExtension(display, extNames[ex], &extOpcodes[ex], &event, &error))
+            extOpcodes[ex] = 0;
+
+    codes = XAddExtension(display);
+    XESetBeforeFlush(display, codes->extension, BeforeFlush);
+
+    profileDisplay = display;
+    parsedSeq = NextRequest(display) - 1;
+    memset(frameCounts, 0, sizeof(frameCounts));
+
+    return 1;
+}
+
+/*
+   Requests from now on belong to part.  Returns the part they belonged
+   to before, so that a part can be nested in another.
+*/
+int ProfilePart(int part)
+{
+    int           prev;
+    unsigned long seq;
+    int           last;
+
+    if (profileDisplay == NULL)
+        return PROFILE_OTHER;
+
+    prev = curPart;
+    curPart = part;
+    seq = NextRequest(profileDisplay);
+    last = (markHead + markCount - 1) % PROFILE_MARKS;
+
+    if (markCount > 0 && marks[last].seq == seq)
+    {
+        marks[last].part = part;
+        return prev;
+    }
+
+    /* Flushing uses up every mark but the one for the next request. */
+    if (markCount == PROFILE_MARKS)
+        XFlush(profileDisplay);
+
+    marks[(markHead + markCount) % PROFILE_MARKS].seq = seq;
+    marks[(markHead + markCount) % PROFILE_MARKS].part = part;
+    markCount++;
+
+    return prev;
+}
+
+/*
+   Count requests sent to the server some other way than through the
+   Xlib output buffer, for the current part.
+*/
+void ProfileCount(int opcode, unsigned long requests, unsigned long bytes,
+                  unsigned long roundTrips, unsigned long flushes)
+{
+    if (profileDisplay != NULL)
+        CountPart(curPart, opcode, requests, bytes, roundTrips, flushes);
+}
+
+/*
+   Write a line of CSV with the traffic flushed since the last one, at
+   the end of a frame that took usec microseconds.
+*/
+void ProfileFrame(long frame, double usec)
+{
+    if (profileDisplay == NULL)
+        return;
+
+    fprintf(profileFile, "%ld,%.3f", frame, usec / 1e3);
+
+    for (int px = 0; px < PROFILE_PARTS; px++)
+        fprintf(profileFile, ",%lu,%lu,%lu,%lu",
+                frameCounts[px].requests,
+                frameCounts[px].bytes,
+                frameCounts[px].roundTrips,
+                frameCounts[px].flushes);
+
+    fprintf(profileFile, "\n");
+    memset(frameCounts, 0, sizeof(frameCounts));
+    profileFrames++;
+}
+
+/*
+   Name of request opcode, into buf if it has no name of its own.
+*/
+static const char *RequestName(int opcode, char *buf, size_t size)
+{
+    if (opcode < 128 && requestNames[opcode] != NULL)
+        return requestNames[opcode];
+
+    for (int ex = 0; extNames[ex] != NULL; ex++)
+        if (extOpcodes[ex] == opcode)
+            return extNames[ex];
+
+    snprintf(buf, size, "opcode %d", opcode);
+
+    return buf;
+}
+
+/*
+   Stop profiling and write a summary of the whole run to out: the
+   traffic of every part, per frame and in all, and what it was made of,
+   the heaviest requests first.
+*/
+void StopProfile(FILE *out)
+{
+    char          name[32];
+    int           best;
+    unsigned char done[256];
+    double        frames;
+
+    if (profileFile == NULL)
+        return;
+
+    fclose(profileFile);
+    profileFile = NULL;
+    profileDisplay = NULL;
+    frames = profileFrames > 0 ? (double) profileFrames : 1.0;
+
+    fprintf(out, "X protocol traffic over %ld frames:\n", profileFrames);
+    fprintf(out, "%-8s %12s %14s %12s %10s %12s %14s\n",
+            "part", "requests", "bytes", "round trips", "flushes", "req/frame", "bytes/frame");
+
+    for (int px = 0; px < PROFILE_PARTS; px++)
+        fprintf(out, "%-8s %12lu %14lu %12lu %10lu %12.1f %14.1f\n",
+                partNames[px],
+                totals[px].requests,
+                totals[px].bytes,
+                totals[px].roundTrips,
+                totals[px].flushes,
+                totals[px].requests / frames,
+                totals[px].bytes / frames);
+
+    for (int px = 0; px < PROFILE_PARTS; px++)
+    {
+        if (totals[px].requests == 0)
+            continue;
+
+        fprintf(out, "%s:\n", partNames[px]);
+        memset(done, 0, sizeof(done));
+
+        for (;;)
+        {
+            best = -1;
+
+            for (int ox = 0; ox < 256; ox++)
+                if (!done[ox] && opRequests[px][ox] > 0 && (best < 0 || opBytes[px][ox] > opBytes[px][best]))
+                    best = ox;
+
+            if (best < 0)
+                break;
+
+            done[best] = 1;
+            fprintf(out, "    %-28s %12lu %14lu\n",
+                    RequestName(best, name, sizeof(name)),
+                    opRequests[px][best],
+                    opBytes[px][best]);
+        }
+    }
+
+    fflush(out);
+}
@@ -0,0 +1,33 @@
+/*
+    X protocol traffic profile of xroach.
+
+    Counts the requests xroach sends by opcode, the bytes written, round
+    trips and flushes, split up by the part of xroach that sent them.  The
+    requests are read out of the Xlib output buffer just before it goes to
+    the server, and belong to the part that was running when they were
+    made, however much later they are flushed.  ProfileFrame writes a line
+    of CSV per frame and StopProfile a summary.
+*/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <X11/Xlib.h>
+
+/* Parts of xroach that send requests. */
+#define PROFILE_OTHER   0    /* setup, events and everything else */
+#define PROFILE_DRAW    1    /* DrawRoaches */
+#define PROFILE_CALC    2    /* CalcRootVisible */
+#define PROFILE_SQUISH  3    /* checkSquish */
+#define PROFILE_SYNC    4    /* flushes and syncs of the main loop */
+#define PROFILE_PARTS   5
+
+int StartProfile(Display *display, const char *path);
+void StopProfile(FILE *out);
+int ProfilePart(int part);
+void ProfileCount(int opcode, unsigned long requests, unsigned long bytes,
+                  unsigned long roundTrips, unsigned long flushes);
+void ProfileFrame(long frame, double usec);
+
+#endif /* PROFILE_H */
@@ -0,0 +1,1730 @@
+/*
+    Roach simulation core for xroach.
+
+    Copyright 1991 by J.T. Anderson
+
+    jta@locus.com
+
+    This program may be freely distributed provided that all
+    copyright notices are retained.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "roach.h"
+#include "roachmap.h"
+
+/*
+   The move kernel handles ROACH_LANES roaches per step: 8 with AVX2, 4
+   with SSE2, and falls back to the plain per-roach loop elsewhere, or
+   when built with ROACH_SCALAR to check the vector kernels against it.
+*/
+#if !defined(ROACH_SCALAR)
+#define ROACH_SCALAR 0
+#endif
+
+#if ROACH_SCALAR
+#define ROACH_LANES 1
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define ROACH_LANES 8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define ROACH_LANES 4
+#else
+#define ROACH_LANES 1
+#endif
+
+Roaches      roaches;
+int          maxRoaches = 10;
+int          curRoaches = 0;
+int          activeRoaches = 0;
+float        roachSpeed = 20.0;
+float        turnSpeed  = 10.0;
+float        roachLerp  = 1.0;
+float        roachSpawn = 0.0;
+unsigned int display_height;
+unsigned int display_width;
+
+int headingDX[ROACH_HEADINGS];
+int headingDY[ROACH_HEADINGS];
+int headingWidth[ROACH_HEADINGS];
+int headingHeight[ROACH_HEADINGS];
+
+/* roachmap.h has a sprite for every heading, all round. */
+typedef char roachPixComplete[sizeof(roachPix) / sizeof(roachPix[0]) == ROACH_HEADINGS &&
+                              ROACH_HEADINGS * ROACH_ANGLE == 360 ? 1 : -1];
+
+int collisionMode = COLLIDE_NONE;
+int roachThreads  = 1;
+int coverSeeking  = 1;
+
+unsigned char *coverCells = NULL;
+int           coverCols   = 0;
+int           coverRows   = 0;
+
+long   roachAllocs     = 0;
+size_t roachAllocBytes = 0;
+
+/*
+   Roach pool.  Address space for maxRoaches roaches is reserved up front,
+   but only ROACH_CHUNK roaches at a time are backed by memory, as the
+   population grows into it, so a roach never has to move to make room.
+   The free slots are the ones past curRoaches; removing a roach fills its
+   place from the end, which keeps the live ones dense for the move kernel.
+*/
+static void   *roachBlock  = NULL;
+static size_t roachStride = 0;
+static int    roachCommit = 0;     /* roaches backed by memory */
+static float  spawnDue    = 0.0;
+
+/*
+   Past the active roaches come the ones waking up, up to wakingEnd, then
+   the ones asleep in hiding.  roachTick counts the ticks, to tell how
+   long a roach has been asleep.
+*/
+static int          wakingEnd = 0;
+static unsigned int roachTick = 0;
+
+/*
+   Random numbers come from PCG32 generators: one for setting things up,
+   and one per roach for everything a roach does during a tick.  With a
+   stream of its own, what a roach does depends only on the seed, not on
+   which thread moves it or what the other roaches drew before it.
+*/
+static uint64_t randState = 0;
+
+/*
+   Worker pool.  Roaches are handed out to the threads ROACH_CHUNK at a
+   time.  ForEachChunk posts a job by bumping poolRound; everyone,
+   the calling thread included, then claims chunks until none are left.
+*/
+static pthread_t       *poolThreads = NULL;
+static int             poolSize     = 0;
+static pthread_mutex_t poolLock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  poolWake     = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  poolDone     = PTHREAD_COND_INITIALIZER;
+static int             poolRound    = 0;
+static int             poolBusy     = 0;
+static int             poolQuit     = 0;
+static int             poolNext;
+static int             poolEnd;
+static int             poolResult;
+static int             (*poolWork)(int from, int to);
+
+static int StartPool();
+static void StopPool();
+static void SwapRoaches(int a, int b);
+static void SleepRoach(int rx);
+static void LinkSleeper(int rx);
+static void UnlinkSleeper(int rx);
+static void WakeRoaches();
+
+/*
+   Spatial hash over the drawn positions: a uniform grid of cells at least
+   as large as a roach.  The roaches in cell c are gridRoaches[gridStart[c]]
+   up to gridRoaches[gridStart[c + 1]], so collision avoidance only has to
+   look at the 3x3 cells around a roach, and a click at the 2x2 cells up
+   and left of it.  gridSlot[rx] is where roach rx sits in gridRoaches, so
+   it can be taken out again in constant time; removed roaches leave -1
+   behind.  The grid goes stale as soon as the roaches move.
+*/
+static int *gridStart   = NULL;
+static int *gridRoaches = NULL;
+static int *gridSlot    = NULL;
+static int gridCell;
+static int gridCols;
+static int gridRows;
+static int gridValid = 0;
+
+/*
+   Cover field.  coverHeading[c] is the heading from cell c to the nearest
+   cell deep enough in cover to hide a roach centred in it, or -1 if the
+   cell is such a cell itself or there is none.  A roach looks up the cell
+   under its centre when it turns, so following the field costs a single
+   table lookup.
+*/
+static signed char *coverHeading = NULL;
+static int         *coverNearest = NULL;
+static int         *coverQueue   = NULL;
+
+/*
+   Sleeping roaches by cover cell.  Sleepers do not move, so each one is
+   filed under the cell of its top left corner, in a list that starts at
+   sleepHead[c] and goes on through sleepNext; sleepCell[rx] is -1 for a
+   roach that is not asleep.  A window going away only has to look at the
+   cells under it.  wakeList is room for the ones it finds.
+*/
+static int *sleepHead = NULL;
+static int *sleepNext = NULL;
+static int *sleepPrev = NULL;
+static int *sleepCell = NULL;
+static int *wakeList  = NULL;
+
+/*
+   Allocate aligned memory for the simulation and keep count of it.
+*/
+static void *RoachAlloc(size_t size)
+{
+    void *mem;
+
+    if (posix_memalign(&mem, ROACH_ALIGN, size) != 0)
+        return NULL;
+
+    roachAllocs++;
+    roachAllocBytes += size;
+
+    return mem;
+}
+
+/*
+   Fill in the per-heading tables for the speed and reserve room for
+   maxRoaches roaches.  All arrays live in one block; each is padded to a
+   whole number of pages, so each can grow in place.  Returns 0 on failure.
+*/
+int InitRoaches()
+{
+    char   *mem;
+    size_t stride;
+    size_t page;
+    size_t room;
+
+    /* Compensate rate of turning for speed of movement. */
+    turnSpeed = 200 / roachSpeed;
+
+    if (turnSpeed < 1)
+        turnSpeed = 1;
+
+    /*
+       The sines and cosines are rounded to float before they are scaled,
+       so every build gets the same fixed point steps.
+    */
+    for (int hx = 0; hx < ROACH_HEADINGS; hx++)
+    {
+        roachPix[hx].sine = (float) sin(hx * ROACH_ANGLE * M_PI / 180);
+        roachPix[hx].cosine = (float) cos(hx * ROACH_ANGLE * M_PI / 180);
+        headingDX[hx] = (int) lround(roachSpeed * roachPix[hx].cosine * ROACH_FIX_ONE);
+        headingDY[hx] = (int) -lround(roachSpeed * roachPix[hx].sine * ROACH_FIX_ONE);
+        headingWidth[hx] = roachPix[hx].width;
+        headingHeight[hx] = roachPix[hx].height;
+    }
+
+    curRoaches = 0;
+    activeRoaches = 0;
+    wakingEnd = 0;
+    roachTick = 0;
+    roachCommit = 0;
+    spawnDue = 0.0;
+    page = (size_t) sysconf(_SC_PAGESIZE);
+
+    /* At least a chunk, so that even room for no roaches is a real mapping. */
+    room = maxRoaches > ROACH_CHUNK ? maxRoaches : ROACH_CHUNK;
+    stride = ((room * sizeof(int) + page - 1) / page) * page;
+    roachBlock = mmap(NULL, stride * 13, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (roachBlock == MAP_FAILED)
+    {
+        roachBlock = NULL;
+        return 0;
+    }
+
+    roachStride = stride;
+
+    mem = (char *) roachBlock;
+    roaches.x     = (int *) (mem + stride * 0);
+    roaches.y     = (int *) (mem + stride * 1);
+    roaches.intX  = (int *) (mem + stride * 2);
+    roaches.intY  = (int *) (mem + stride * 3);
+    roaches.index = (int *) (mem + stride * 4);
+    roaches.drawn = (int *) (mem + stride * 5);
+    roaches.steps = (int *) (mem + stride * 6);
+    roaches.flags = (int *) (mem + stride * 7);
+    roaches.lastX = (int *) (mem + stride * 8);
+    roaches.lastY = (int *) (mem + stride * 9);
+    roaches.hiddenAt = (int *) (mem + stride * 10);
+    roaches.rng   = (uint64_t *) (mem + stride * 11);
+
+    gridCell = 1;
+    gridValid = 0;
+
+    for (int hx = 0; hx < ROACH_HEADINGS; hx++)
+    {
+        if (headingWidth[hx] > gridCell)
+            gridCell = headingWidth[hx];
+
+        if (headingHeight[hx] > gridCell)
+            gridCell = headingHeight[hx];
+    }
+
+    gridCols = (int) display_width / gridCell + 1;
+    gridRows = (int) display_height / gridCell + 1;
+    gridStart = (int *) RoachAlloc(sizeof(int) * (gridCols * gridRows + 1));
+    gridRoaches = (int *) RoachAlloc(sizeof(int) * room);
+    gridSlot = (int *) RoachAlloc(sizeof(int) * room);
+
+    if (gridStart == NULL || gridRoaches == NULL || gridSlot == NULL)
+        return 0;
+
+    coverCols = (int) (display_width + (1 << COVER_SHIFT) - 1) >> COVER_SHIFT;
+    coverRows = (int) (display_height + (1 << COVER_SHIFT) - 1) >> COVER_SHIFT;
+    coverCells = (unsigned char *) RoachAlloc((size_t) (coverCols * coverRows));
+    coverHeading = (signed char *) RoachAlloc((size_t) (coverCols * coverRows));
+    coverNearest = (int *) RoachAlloc(sizeof(int) * coverCols * coverRows);
+    coverQueue = (int *) RoachAlloc(sizeof(int) * coverCols * coverRows);
+
+    if (coverCells == NULL || coverHeading == NULL || coverNearest == NULL || coverQueue == NULL)
+        return 0;
+
+    sleepHead = (int *) RoachAlloc(sizeof(int) * coverCols * coverRows);
+    sleepNext = (int *) RoachAlloc(sizeof(int) * room);
+    sleepPrev = (int *) RoachAlloc(sizeof(int) * room);
+    sleepCell = (int *) RoachAlloc(sizeof(int) * room);
+    wakeList = (int *) RoachAlloc(sizeof(int) * room);
+
+    if (sleepHead == NULL || sleepNext == NULL || sleepPrev == NULL || sleepCell == NULL || wakeList == NULL)
+        return 0;
+
+    memset(sleepHead, -1, sizeof(int) * coverCols * coverRows);
+
+    /* Until told otherwise nothing is covered, and roaches just wander. */
+    memset(coverCells, 0, (size_t) (coverCols * coverRows));
+    memset(coverHeading, -1, (size_t) (coverCols * coverRows));
+
+    if (roachThreads > 1 && !StartPool())
+        return 0;
+
+    return 1;
+}
+
+void FreeRoaches()
+{
+    if (roachBlock != NULL)
+        munmap(roachBlock, roachStride * 13);
+
+    free(gridStart);
+    free(gridRoaches);
+    free(gridSlot);
+    free(coverCells);
+    free(coverHeading);
+    free(coverNearest);
+    free(coverQueue);
+    free(sleepHead);
+    free(sleepNext);
+    free(sleepPrev);
+    free(sleepCell);
+    free(wakeList);
+    StopPool();
+    roachBlock = NULL;
+    gridStart = NULL;
+    gridRoaches = NULL;
+    gridSlot = NULL;
+    coverCells = NULL;
+    coverHeading = NULL;
+    coverNearest = NULL;
+    coverQueue = NULL;
+    sleepHead = NULL;
+    sleepNext = NULL;
+    sleepPrev = NULL;
+    sleepCell = NULL;
+    wakeList = NULL;
+    gridValid = 0;
+    curRoaches = 0;
+    activeRoaches = 0;
+    wakingEnd = 0;
+}
+
+/*
+   Scramble a 64 bit value (SplitMix64), to turn seeds that are close
+   together into unrelated generator states.
+*/
+static uint64_t MixSeed(uint64_t z)
+{
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+/*
+   Step a PCG32 generator and return its next 32 bits.
+*/
+static uint32_t Rand32(uint64_t *state)
+{
+    uint64_t old;
+    uint32_t shifted;
+    uint32_t rot;
+
+    old = *state;
+    *state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+    shifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+    rot = (uint32_t) (old >> 59);
+
+    return (shifted >> rot) | (shifted << ((-rot) & 31));
+}
+
+/*
+   Random integer between 0 and maxVal-1, without the bias of taking the
+   remainder: multiply into 64 bits and reject the few draws that would
+   make the low end more likely (Lemire).
+*/
+static int RandBelow(uint64_t *state, int maxVal)
+{
+    uint64_t product;
+    uint32_t bound;
+    uint32_t threshold;
+
+    if (maxVal <= 1)
+        return 0;
+
+    bound = (uint32_t) maxVal;
+    product = (uint64_t) Rand32(state) * bound;
+
+    if ((uint32_t) product < bound)
+    {
+        threshold = -bound % bound;
+
+        while ((uint32_t) product < threshold)
+            product = (uint64_t) Rand32(state) * bound;
+    }
+
+    return (int) (product >> 32);
+}
+
+/*
+   Seed the generators.  The same seed gives the same roaches doing the
+   same things.
+*/
+void SeedRoaches(uint64_t seed)
+{
+    randState = MixSeed(seed);
+}
+
+/*
+   Generate random integer between 0 and maxVal-1.
+*/
+int RandInt(int maxVal)
+{
+    return RandBelow(&randState, maxVal);
+}
+
+/*
+   Generate random integer between 0 and maxVal-1 from the stream of roach
+   rx.  Used for everything that happens during a tick.
+*/
+static int RoachRandInt(int rx, int maxVal)
+{
+    return RandBelow(&roaches.rng[rx], maxVal);
+}
+
+/*
+   Claim chunks of the current job until there are none left.
+*/
+static void RunChunks()
+{
+    int chunk;
+    int from;
+    int result;
+    int to;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&poolLock);
+        chunk = poolNext++;
+        pthread_mutex_unlock(&poolLock);
+
+        from = chunk * ROACH_CHUNK;
+
+        if (from >= poolEnd)
+            break;
+
+        to = from + ROACH_CHUNK < poolEnd ? from + ROACH_CHUNK : poolEnd;
+        result = poolWork(from, to);
+
+        pthread_mutex_lock(&poolLock);
+        poolResult += result;
+        pthread_mutex_unlock(&poolLock);
+    }
+}
+
+static void *PoolThread(void *arg)
+{
+    int round = 0;
+
+    (void) arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&poolLock);
+
+        while (poolRound == round && !poolQuit)
+            pthread_cond_wait(&poolWake, &poolLock);
+
+        if (poolQuit)
+        {
+            pthread_mutex_unlock(&poolLock);
+            return NULL;
+        }
+
+        round = poolRound;
+        pthread_mutex_unlock(&poolLock);
+
+        RunChunks();
+
+        pthread_mutex_lock(&poolLock);
+
+        if (--poolBusy == 0)
+            pthread_cond_signal(&poolDone);
+
+        pthread_mutex_unlock(&poolLock);
+    }
+}
+
+/*
+   Run work over the active roaches, a chunk at a time, spread over the
+   pool, and return the sum of what it returned.  Chunks must not touch
+   each other's roaches.
+*/
+int ForEachChunk(int (*work)(int from, int to))
+{
+    poolWork = work;
+    poolNext = 0;
+    poolEnd = activeRoaches;
+    poolResult = 0;
+
+    if (poolSize == 0 || activeRoaches <= ROACH_CHUNK)
+    {
+        RunChunks();
+        return poolResult;
+    }
+
+    pthread_mutex_lock(&poolLock);
+    poolBusy = poolSize;
+    poolRound++;
+    pthread_cond_broadcast(&poolWake);
+    pthread_mutex_unlock(&poolLock);
+
+    RunChunks();
+
+    pthread_mutex_lock(&poolLock);
+
+    while (poolBusy > 0)
+        pthread_cond_wait(&poolDone, &poolLock);
+
+    pthread_mutex_unlock(&poolLock);
+
+    return poolResult;
+}
+
+/*
+   Start roachThreads - 1 workers; the thread calling ForEachChunk is the
+   last one.
+*/
+static int StartPool()
+{
+    poolQuit = 0;
+    poolRound = 0;
+    poolThreads = (pthread_t *) malloc(sizeof(pthread_t) * roachThreads);
+
+    if (poolThreads == NULL)
+        return 0;
+
+    for (poolSize = 0; poolSize < roachThreads - 1; poolSize++)
+        if (pthread_create(&poolThreads[poolSize], NULL, PoolThread, NULL) != 0)
+            return 0;
+
+    return 1;
+}
+
+static void StopPool()
+{
+    pthread_mutex_lock(&poolLock);
+    poolQuit = 1;
+    pthread_cond_broadcast(&poolWake);
+    pthread_mutex_unlock(&poolLock);
+
+    for (int tx = 0; tx < poolSize; tx++)
+        pthread_join(poolThreads[tx], NULL);
+
+    free(poolThreads);
+    poolThreads = NULL;
+    poolSize = 0;
+}
+
+/*
+   Check for roach completely in specified rectangle.
+*/
+int RoachInRect(int roach, int rx, int ry, int x, int y, unsigned int width, unsigned int height)
+{
+    if (rx < x)
+        return 0;
+
+    if ((rx + headingWidth[roaches.drawn[roach]]) > (x + width))
+        return 0;
+
+    if (ry < y)
+        return 0;
+
+    if ((ry + headingHeight[roaches.drawn[roach]]) > (y + height))
+        return 0;
+
+    return 1;
+}
+
+/*
+   Check for roach overlapping specified rectangle.
+*/
+int RoachOverRect(int roach, int rx, int ry, int x, int y, unsigned int width, unsigned int height)
+{
+    if (rx >= (x + width))
+        return 0;
+
+    if ((rx + headingWidth[roaches.drawn[roach]]) <= x)
+        return 0;
+
+    if (ry >= (y + height))
+        return 0;
+
+    if ((ry + headingHeight[roaches.drawn[roach]]) <= y)
+        return 0;
+
+    return 1;
+}
+
+/*
+   Back ROACH_CHUNK more roaches of the pool with memory.  Each array is
+   grown in place, rounded out to whole pages.  Returns 0 on failure.
+*/
+static int GrowRoaches()
+{
+    size_t page;
+    size_t from;
+    size_t to;
+    int    count;
+    char   *mem;
+
+    count = roachCommit + ROACH_CHUNK < maxRoaches ? roachCommit + ROACH_CHUNK : maxRoaches;
+    page = (size_t) sysconf(_SC_PAGESIZE);
+    mem = (char *) roachBlock;
+
+    /* Eleven int arrays and the rng, which takes the room of two. */
+    for (int ax = 0; ax < 12; ax++)
+    {
+        from = ax < 11 ? sizeof(int) * roachCommit : sizeof(uint64_t) * roachCommit;
+        to = ax < 11 ? sizeof(int) * count : sizeof(uint64_t) * count;
+        from = roachStride * ax + from / page * page;
+        to = roachStride * ax + (to + page - 1) / page * page;
+
+        if (mprotect(mem + from, to - from, PROT_READ | PROT_WRITE) != 0)
+            return 0;
+    }
+
+    roachAllocs++;
+    roachAllocBytes += (sizeof(int) * 11 + sizeof(uint64_t)) * (count - roachCommit);
+    roachCommit = count;
+
+    return 1;
+}
+
+/*
+   Give birth to a roach, out in the open.  Returns where it went, or -1
+   if there is no room for it.
+*/
+static int NewRoach()
+{
+    int      rx;
+    uint64_t seed;
+
+    if (curRoaches >= maxRoaches || (curRoaches == roachCommit && !GrowRoaches()))
+        return -1;
+
+    rx = curRoaches++;
+    roaches.index[rx] = RandInt(ROACH_HEADINGS);
+    roaches.drawn[rx] = roaches.index[rx];
+    roaches.x[rx] = RandInt(display_width - headingWidth[roaches.drawn[rx]]) << ROACH_FIX_SHIFT;
+    roaches.y[rx] = RandInt(display_height - headingHeight[roaches.drawn[rx]]) << ROACH_FIX_SHIFT;
+    roaches.lastX[rx] = roaches.x[rx];
+    roaches.lastY[rx] = roaches.y[rx];
+    seed = Rand32(&randState);
+    roaches.rng[rx] = MixSeed(seed << 32 | Rand32(&randState));
+    roaches.intX[rx] = -1;
+    roaches.intY[rx] = -1;
+    roaches.steps[rx] = RandInt((int) turnSpeed);
+    roaches.flags[rx] = RandInt(100) >= 50 ? ROACH_TURN_LEFT : 0;
+    roaches.hiddenAt[rx] = (int) roachTick;
+    gridSlot[rx] = -1;
+    sleepCell[rx] = -1;
+
+    /* Make room for it among the active roaches, past the waking ones. */
+    SwapRoaches(rx, wakingEnd);
+    SwapRoaches(wakingEnd++, activeRoaches);
+
+    return activeRoaches++;
+}
+
+/*
+   Give birth to a roach.  Returns 0 if there is no room for it.
+*/
+int AddRoach()
+{
+    return NewRoach() >= 0;
+}
+
+/*
+   Give birth to roaches until there are count of them, or maxRoaches.
+   Returns 0 if there is no memory for them.
+*/
+int AddRoaches(int count)
+{
+    if (count > maxRoaches)
+        count = maxRoaches;
+
+    while (curRoaches < count)
+        if (!AddRoach())
+            return 0;
+
+    return 1;
+}
+
+/*
+   A random roach has a baby, which starts out where its parent is and
+   hidden if its parent is.  The baby of a roach that is waking up wakes
+   up with it.  Returns 0 if there is no room or no parent.
+*/
+int BreedRoach()
+{
+    int parent;
+    int rx;
+    int x;
+    int y;
+    int hidden;
+    int waking;
+
+    if (curRoaches == 0)
+        return 0;
+
+    parent = RandInt(curRoaches);
+    x = roaches.x[parent];
+    y = roaches.y[parent];
+    hidden = roaches.flags[parent] & ROACH_HIDDEN;
+    waking = parent >= activeRoaches && parent < wakingEnd;
+    rx = NewRoach();
+
+    if (rx < 0)
+        return 0;
+
+    roaches.x[rx] = x;
+    roaches.y[rx] = y;
+    roaches.lastX[rx] = x;
+    roaches.lastY[rx] = y;
+
+    /* Never drawn, so it can go straight into hiding. */
+    if (hidden)
+        roaches.flags[rx] |= ROACH_HIDDEN;
+
+    /* The last active roach is the first waking one once there is one less. */
+    if (waking)
+        activeRoaches--;
+    else if (hidden)
+        SleepRoach(rx);
+
+    return 1;
+}
+
+/*
+   Copy roach from over roach to.
+*/
+void CopyRoach(int to, int from)
+{
+    roaches.x[to] = roaches.x[from];
+    roaches.y[to] = roaches.y[from];
+    roaches.intX[to] = roaches.intX[from];
+    roaches.intY[to] = roaches.intY[from];
+    roaches.index[to] = roaches.index[from];
+    roaches.drawn[to] = roaches.drawn[from];
+    roaches.steps[to] = roaches.steps[from];
+    roaches.flags[to] = roaches.flags[from];
+    roaches.lastX[to] = roaches.lastX[from];
+    roaches.lastY[to] = roaches.lastY[from];
+    roaches.hiddenAt[to] = roaches.hiddenAt[from];
+    roaches.rng[to] = roaches.rng[from];
+}
+
+/*
+   Heading of the cover field under the centre of roach rx, or -1.
+*/
+static int CoverHeading(int rx)
+{
+    int cx;
+    int cy;
+
+    if (!coverSeeking)
+        return -1;
+
+    cx = ((roaches.x[rx] >> ROACH_FIX_SHIFT) + headingWidth[roaches.drawn[rx]] / 2) >> COVER_SHIFT;
+    cy = ((roaches.y[rx] >> ROACH_FIX_SHIFT) + headingHeight[roaches.drawn[rx]] / 2) >> COVER_SHIFT;
+
+    if (cx < 0 || cx >= coverCols || cy < 0 || cy >= coverRows)
+        return -1;
+
+    return coverHeading[cy * coverCols + cx];
+}
+
+/*
+   Turn a roach.  Most turns steer towards cover, if there is any, by the
+   same few headings at a time a roach turns anyway; the rest stay random,
+   so roaches stuck against an edge or each other still get away.
+*/
+void TurnRoach(int rx)
+{
+    int heading;
+    int turn;
+    int step;
+
+    if (roaches.index[rx] != roaches.drawn[rx])
+        return;
+
+    heading = CoverHeading(rx);
+
+    if (heading >= 0 && RoachRandInt(rx, 100) < COVER_BIAS)
+    {
+        turn = heading - roaches.index[rx];
+
+        if (turn > ROACH_HEADINGS / 2)
+            turn -= ROACH_HEADINGS;
+        else if (turn <= -ROACH_HEADINGS / 2)
+            turn += ROACH_HEADINGS;
+
+        step = (RoachRandInt(rx, 30) / 10) + 1;
+
+        if (step > abs(turn))
+            step = abs(turn);
+
+        roaches.index[rx] += turn < 0 ? -step : step;
+
+        if (roaches.index[rx] >= ROACH_HEADINGS)
+            roaches.index[rx] -= ROACH_HEADINGS;
+        else if (roaches.index[rx] < 0)
+            roaches.index[rx] += ROACH_HEADINGS;
+
+        return;
+    }
+
+    if (roaches.flags[rx] & ROACH_TURN_LEFT)
+    {
+        roaches.index[rx] += (RoachRandInt(rx, 30) / 10) + 1;
+
+        if (roaches.index[rx] >= ROACH_HEADINGS)
+            roaches.index[rx] -= ROACH_HEADINGS;
+    }
+    else
+    {
+        roaches.index[rx] -= (RoachRandInt(rx, 30) / 10) + 1;
+
+        if (roaches.index[rx] < 0)
+            roaches.index[rx] += ROACH_HEADINGS;
+    }
+}
+
+/*
+   Count down the steps of a roach that has just moved, and turn it when
+   it has walked far enough.
+*/
+static void WalkRoach(int rx)
+{
+    if (roaches.steps[rx]-- <= 0)
+    {
+        TurnRoach(rx);
+        roaches.steps[rx] = RoachRandInt(rx, (int) turnSpeed);
+
+        /*
+           Previously, roaches would just go around in circles.
+           This makes their movement more interesting (and disgusting too!).
+        */
+        if (RoachRandInt(rx, 100) >= 80)
+            roaches.flags[rx] ^= ROACH_TURN_LEFT;
+    }
+}
+
+/*
+   Sort the drawn roaches into the grid cells, by counting.
+*/
+static void BuildGrid()
+{
+    int cell;
+    int nCells;
+
+    nCells = gridCols * gridRows;
+    memset(gridStart, 0, sizeof(int) * (nCells + 1));
+
+    for (int rx = 0; rx < activeRoaches; rx++)
+        if (roaches.intX[rx] >= 0)
+            gridStart[(roaches.intY[rx] / gridCell) * gridCols + roaches.intX[rx] / gridCell + 1]++;
+
+    for (int cx = 0; cx < nCells; cx++)
+        gridStart[cx + 1] += gridStart[cx];
+
+    /* Filling moves gridStart[c] to the end of cell c; shift it back. */
+    for (int rx = 0; rx < activeRoaches; rx++)
+    {
+        if (roaches.intX[rx] >= 0)
+        {
+            cell = (roaches.intY[rx] / gridCell) * gridCols + roaches.intX[rx] / gridCell;
+            gridSlot[rx] = gridStart[cell];
+            gridRoaches[gridStart[cell]++] = rx;
+        }
+        else
+        {
+            gridSlot[rx] = -1;
+        }
+    }
+
+    for (int rx = activeRoaches; rx < curRoaches; rx++)
+        gridSlot[rx] = -1;
+
+    for (int cx = nCells; cx > 0; cx--)
+        gridStart[cx] = gridStart[cx - 1];
+
+    gridStart[0] = 0;
+    gridValid = 1;
+}
+
+/*
+   Turn a roach that has just moved if it now runs into another one where
+   that one was last drawn.  Earlier versions scanned every other roach for
+   this, which was far too slow, and skipped the roach right after this one.
+*/
+static void AvoidRoaches(int rx)
+{
+    int cx;
+    int cy;
+    int newX;
+    int newY;
+    int other;
+
+    newX = roaches.x[rx] >> ROACH_FIX_SHIFT;
+    newY = roaches.y[rx] >> ROACH_FIX_SHIFT;
+
+    if (collisionMode == COLLIDE_BRUTE)
+    {
+        for (other = 0; other < activeRoaches; other++)
+        {
+            if (other == rx || roaches.intX[other] < 0)
+                continue;
+
+            if (RoachOverRect(rx,
+                              newX, newY,
+                              roaches.intX[other], roaches.intY[other],
+                              (unsigned int) headingWidth[roaches.drawn[other]],
+                              (unsigned int) headingHeight[roaches.drawn[other]]))
+            {
+                TurnRoach(rx);
+                return;
+            }
+        }
+    }
+    else if (collisionMode == COLLIDE_GRID)
+    {
+        cx = newX / gridCell;
+        cy = newY / gridCell;
+
+        for (int gy = cy - 1; gy <= cy + 1; gy++)
+        {
+            if (gy < 0 || gy >= gridRows)
+                continue;
+
+            for (int gx = cx - 1; gx <= cx + 1; gx++)
+            {
+                if (gx < 0 || gx >= gridCols)
+                    continue;
+
+                for (int gr = gridStart[gy * gridCols + gx]; gr < gridStart[gy * gridCols + gx + 1]; gr++)
+                {
+                    other = gridRoaches[gr];
+
+                    if (other == rx || other < 0)
+                        continue;
+
+                    if (RoachOverRect(rx,
+                                      newX, newY,
+                                      roaches.intX[other], roaches.intY[other],
+                                      (unsigned int) headingWidth[roaches.drawn[other]],
+                                      (unsigned int) headingHeight[roaches.drawn[other]]))
+                    {
+                        TurnRoach(rx);
+                        return;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+   Move a roach.
+*/
+void MoveRoach(int rx)
+{
+    int newX;
+    int newY;
+
+    newX = roaches.x[rx] + headingDX[roaches.drawn[rx]];
+    newY = roaches.y[rx] + headingDY[roaches.drawn[rx]];
+
+    if (RoachInRect(rx,
+                    newX >> ROACH_FIX_SHIFT, newY >> ROACH_FIX_SHIFT,
+                    0, 0,
+                    display_width, display_height))
+    {
+        roaches.x[rx] = newX;
+        roaches.y[rx] = newY;
+
+        WalkRoach(rx);
+        AvoidRoaches(rx);
+    }
+    else
+    {
+        TurnRoach(rx);
+    }
+}
+
+#if ROACH_LANES > 1
+/*
+   Move ROACH_LANES roaches starting at rx, which must be a multiple of
+   ROACH_LANES.  Positions are stepped and bounds checked against the
+   screen in one pass; roaches that are hidden or would leave the screen
+   keep their old position.  Returns a bit mask of the roaches that moved.
+*/
+static int MoveLanes(int rx)
+{
+    const int *d = &roaches.drawn[rx];
+
+#if ROACH_LANES == 8
+    __m256i drawn  = _mm256_load_si256((const __m256i *) d);
+    __m256i dx     = _mm256_i32gather_epi32(headingDX, drawn, 4);
+    __m256i dy     = _mm256_i32gather_epi32(headingDY, drawn, 4);
+    __m256i w      = _mm256_i32gather_epi32(headingWidth, drawn, 4);
+    __m256i h      = _mm256_i32gather_epi32(headingHeight, drawn, 4);
+    __m256i x      = _mm256_load_si256((const __m256i *) &roaches.x[rx]);
+    __m256i y      = _mm256_load_si256((const __m256i *) &roaches.y[rx]);
+    __m256i flags  = _mm256_load_si256((const __m256i *) &roaches.flags[rx]);
+    __m256i zero   = _mm256_setzero_si256();
+    __m256i hidden = _mm256_set1_epi32(ROACH_HIDDEN);
+    __m256i newX   = _mm256_add_epi32(x, dx);
+    __m256i newY   = _mm256_add_epi32(y, dy);
+    __m256i intX   = _mm256_srai_epi32(newX, ROACH_FIX_SHIFT);
+    __m256i intY   = _mm256_srai_epi32(newY, ROACH_FIX_SHIFT);
+    __m256i keep;
+
+    keep = _mm256_or_si256(_mm256_cmpgt_epi32(zero, intX),
+                           _mm256_cmpgt_epi32(_mm256_add_epi32(intX, w),
+                                              _mm256_set1_epi32((int) display_width)));
+    keep = _mm256_or_si256(keep, _mm256_cmpgt_epi32(zero, intY));
+    keep = _mm256_or_si256(keep,
+                           _mm256_cmpgt_epi32(_mm256_add_epi32(intY, h),
+                                              _mm256_set1_epi32((int) display_height)));
+    keep = _mm256_or_si256(keep, _mm256_cmpeq_epi32(_mm256_and_si256(flags, hidden), hidden));
+
+    _mm256_store_si256((__m256i *) &roaches.x[rx], _mm256_blendv_epi8(newX, x, keep));
+    _mm256_store_si256((__m256i *) &roaches.y[rx], _mm256_blendv_epi8(newY, y, keep));
+
+    return ~_mm256_movemask_ps(_mm256_castsi256_ps(keep)) & 0xff;
+#else
+    __m128i dx     = _mm_set_epi32(headingDX[d[3]], headingDX[d[2]], headingDX[d[1]], headingDX[d[0]]);
+    __m128i dy     = _mm_set_epi32(headingDY[d[3]], headingDY[d[2]], headingDY[d[1]], headingDY[d[0]]);
+    __m128i w      = _mm_set_epi32(headingWidth[d[3]], headingWidth[d[2]],
+                                   headingWidth[d[1]], headingWidth[d[0]]);
+    __m128i h      = _mm_set_epi32(headingHeight[d[3]], headingHeight[d[2]],
+                                   headingHeight[d[1]], headingHeight[d[0]]);
+    __m128i x      = _mm_load_si128((const __m128i *) &roaches.x[rx]);
+    __m128i y      = _mm_load_si128((const __m128i *) &roaches.y[rx]);
+    __m128i flags  = _mm_load_si128((const __m128i *) &roaches.flags[rx]);
+    __m128i zero   = _mm_setzero_si128();
+    __m128i hidden = _mm_set1_epi32(ROACH_HIDDEN);
+    __m128i newX   = _mm_add_epi32(x, dx);
+    __m128i newY   = _mm_add_epi32(y, dy);
+    __m128i intX   = _mm_srai_epi32(newX, ROACH_FIX_SHIFT);
+    __m128i intY   = _mm_srai_epi32(newY, ROACH_FIX_SHIFT);
+    __m128i keep;
+
+    keep = _mm_or_si128(_mm_cmplt_epi32(intX, zero),
+                        _mm_cmpgt_epi32(_mm_add_epi32(intX, w),
+                                        _mm_set1_epi32((int) display_width)));
+    keep = _mm_or_si128(keep, _mm_cmplt_epi32(intY, zero));
+    keep = _mm_or_si128(keep,
+                        _mm_cmpgt_epi32(_mm_add_epi32(intY, h),
+                                        _mm_set1_epi32((int) display_height)));
+    keep = _mm_or_si128(keep, _mm_cmpeq_epi32(_mm_and_si128(flags, hidden), hidden));
+
+    _mm_store_si128((__m128i *) &roaches.x[rx], _mm_or_si128(_mm_and_si128(keep, x), _mm_andnot_si128(keep, newX)));
+    _mm_store_si128((__m128i *) &roaches.y[rx], _mm_or_si128(_mm_and_si128(keep, y), _mm_andnot_si128(keep, newY)));
+
+    return ~_mm_movemask_ps(_mm_castsi128_ps(keep)) & 0xf;
+#endif
+}
+#endif
+
+/*
+   Move the roaches from up to to that are not hidden.
+*/
+static int MoveChunk(int from, int to)
+{
+    int rx = from;
+
+    memcpy(&roaches.lastX[from], &roaches.x[from], sizeof(int) * (to - from));
+    memcpy(&roaches.lastY[from], &roaches.y[from], sizeof(int) * (to - from));
+
+#if ROACH_LANES > 1
+    int moved;
+
+    for (; rx + ROACH_LANES <= to; rx += ROACH_LANES)
+    {
+        moved = MoveLanes(rx);
+
+        for (int lx = 0; lx < ROACH_LANES; lx++)
+        {
+            if (moved & (1 << lx))
+            {
+                WalkRoach(rx + lx);
+                AvoidRoaches(rx + lx);
+            }
+            else if (!(roaches.flags[rx + lx] & ROACH_HIDDEN))
+                TurnRoach(rx + lx);
+        }
+    }
+#endif
+
+    for (; rx < to; rx++)
+        if (!(roaches.flags[rx] & ROACH_HIDDEN))
+            MoveRoach(rx);
+
+    return 0;
+}
+
+/*
+   Wake up uncovered roaches, breed roachSpawn roaches a tick, and move
+   all roaches that are not hidden.
+*/
+void MoveRoaches()
+{
+    roachTick++;
+
+    if (wakingEnd > activeRoaches)
+        WakeRoaches();
+
+    /* Breeding happens between ticks, so it does not depend on threads. */
+    if (roachSpawn > 0)
+    {
+        spawnDue += roachSpawn;
+
+        while (spawnDue >= 1.0f)
+        {
+            spawnDue -= 1.0f;
+            BreedRoach();
+        }
+    }
+
+    if (collisionMode == COLLIDE_GRID)
+        BuildGrid();
+
+    ForEachChunk(MoveChunk);
+
+    /* The roaches get drawn, and settled, at their new spots next. */
+    gridValid = 0;
+}
+
+/*
+   Check whether the point x, y hits roach rx where it was last drawn.
+   The edge of the sprite does not count, as it never has.  With exact,
+   the point must also land on a set pixel of the sprite.
+*/
+static int RoachHit(int rx, int x, int y, int exact)
+{
+    RoachMap *rp;
+    int      px;
+    int      py;
+
+    /* Not drawn, or taken off the screen since the grid was built. */
+    if (roaches.intX[rx] < 0)
+        return 0;
+
+    rp = &roachPix[roaches.drawn[rx]];
+    px = x - roaches.intX[rx];
+    py = y - roaches.intY[rx];
+
+    if (px <= 0 || px >= rp->width || py <= 0 || py >= rp->height)
+        return 0;
+
+    if (!exact)
+        return 1;
+
+    /* XBM rows are padded to whole bytes, least significant bit first. */
+    return (rp->roachBits[py * ((rp->width + 7) / 8) + px / 8] >> (px & 7)) & 1;
+}
+
+/*
+   Find up to maxHits drawn roaches under the point x, y and store them in
+   hits, highest index first, so they can be handed to RemoveRoach in that
+   order.  Returns the number found.  The grid is built on the first call
+   after the roaches have moved or been settled somewhere new, and reused
+   until then.
+*/
+int RoachesAt(int x, int y, int exact, int *hits, int maxHits)
+{
+    int cx;
+    int cy;
+    int nHits;
+    int other;
+    int hx;
+
+    if (!gridValid)
+        BuildGrid();
+
+    if (x < 0 || y < 0)
+        return 0;
+
+    cx = x / gridCell;
+    cy = y / gridCell;
+    nHits = 0;
+
+    /* A roach is no larger than a cell, so it starts in this cell or the ones up and left. */
+    for (int gy = cy - 1; gy <= cy; gy++)
+    {
+        if (gy < 0 || gy >= gridRows)
+            continue;
+
+        for (int gx = cx - 1; gx <= cx; gx++)
+        {
+            if (gx < 0 || gx >= gridCols)
+                continue;
+
+            for (int gr = gridStart[gy * gridCols + gx]; gr < gridStart[gy * gridCols + gx + 1]; gr++)
+            {
+                other = gridRoaches[gr];
+
+                if (other < 0 || !RoachHit(other, x, y, exact))
+                    continue;
+
+                if (nHits == maxHits)
+                {
+                    if (other < hits[maxHits - 1])
+                        continue;
+
+                    nHits--;
+                }
+
+                for (hx = nHits; hx > 0 && hits[hx - 1] < other; hx--)
+                    hits[hx] = hits[hx - 1];
+
+                hits[hx] = other;
+                nHits++;
+            }
+        }
+    }
+
+    return nHits;
+}
+
+/*
+   Move roach from into the place of roach to, keeping the grid up to date
+   if it is.
+*/
+static void MoveSlot(int to, int from)
+{
+    if (to == from)
+        return;
+
+    if (gridValid)
+    {
+        gridSlot[to] = gridSlot[from];
+
+        if (gridSlot[to] >= 0)
+            gridRoaches[gridSlot[to]] = to;
+    }
+
+    sleepCell[to] = sleepCell[from];
+    sleepNext[to] = sleepNext[from];
+    sleepPrev[to] = sleepPrev[from];
+    sleepCell[from] = -1;
+
+    if (sleepCell[to] >= 0)
+    {
+        if (sleepPrev[to] >= 0)
+            sleepNext[sleepPrev[to]] = to;
+        else
+            sleepHead[sleepCell[to]] = to;
+
+        if (sleepNext[to] >= 0)
+            sleepPrev[sleepNext[to]] = to;
+    }
+
+    CopyRoach(to, from);
+}
+
+/*
+   Swap roaches a and b, keeping the grid up to date if it is, and the
+   sleeper lists always.
+*/
+static void SwapRoaches(int a, int b)
+{
+    int      t;
+    uint64_t r;
+    int      *arrays[] = {roaches.x, roaches.y, roaches.intX, roaches.intY, roaches.index,
+                          roaches.drawn, roaches.steps, roaches.flags, roaches.lastX, roaches.lastY,
+                          roaches.hiddenAt, sleepCell, sleepNext, sleepPrev};
+    int      ends[2];
+
+    if (a == b)
+        return;
+
+    for (int ax = 0; ax < (int) (sizeof(arrays) / sizeof(arrays[0])); ax++)
+    {
+        t = arrays[ax][a];
+        arrays[ax][a] = arrays[ax][b];
+        arrays[ax][b] = t;
+    }
+
+    r = roaches.rng[a];
+    roaches.rng[a] = roaches.rng[b];
+    roaches.rng[b] = r;
+
+    if (gridValid)
+    {
+        t = gridSlot[a];
+        gridSlot[a] = gridSlot[b];
+        gridSlot[b] = t;
+
+        if (gridSlot[a] >= 0)
+            gridRoaches[gridSlot[a]] = a;
+
+        if (gridSlot[b] >= 0)
+            gridRoaches[gridSlot[b]] = b;
+    }
+
+    /* a and b may be next to each other, so fix up both before relinking. */
+    ends[0] = a;
+    ends[1] = b;
+
+    for (int ex = 0; ex < 2; ex++)
+    {
+        if (sleepNext[ends[ex]] == a || sleepNext[ends[ex]] == b)
+            sleepNext[ends[ex]] = sleepNext[ends[ex]] == a ? b : a;
+
+        if (sleepPrev[ends[ex]] == a || sleepPrev[ends[ex]] == b)
+            sleepPrev[ends[ex]] = sleepPrev[ends[ex]] == a ? b : a;
+    }
+
+    for (int ex = 0; ex < 2; ex++)
+    {
+        if (sleepCell[ends[ex]] < 0)
+            continue;
+
+        if (sleepPrev[ends[ex]] >= 0)
+            sleepNext[sleepPrev[ends[ex]]] = ends[ex];
+        else
+            sleepHead[sleepCell[ends[ex]]] = ends[ex];
+
+        if (sleepNext[ends[ex]] >= 0)
+            sleepPrev[sleepNext[ends[ex]]] = ends[ex];
+    }
+}
+
+/*
+   Remove a roach.  The last active roach fills its place, the last
+   waking roach fills that one's, and the last roach that one's.  Any
+   order of the roaches is as good as another, and this keeps removal
+   constant time; the grid is patched rather than rebuilt.  Only roaches
+   from rx up move, so lower ones found by RoachesAt can still be removed
+   after it.
+*/
+void RemoveRoach(int rx)
+{
+    if (gridValid && gridSlot[rx] >= 0)
+        gridRoaches[gridSlot[rx]] = -1;
+
+    if (sleepCell[rx] >= 0)
+        UnlinkSleeper(rx);
+
+    if (rx < activeRoaches)
+    {
+        activeRoaches--;
+        MoveSlot(rx, activeRoaches);
+        rx = activeRoaches;
+    }
+
+    if (rx < wakingEnd)
+    {
+        wakingEnd--;
+        MoveSlot(rx, wakingEnd);
+        rx = wakingEnd;
+    }
+
+    MoveSlot(rx, curRoaches - 1);
+    curRoaches--;
+}
+
+/*
+   Send active roach rx to sleep in hiding, at the head of the sleeping
+   ones.
+*/
+static void SleepRoach(int rx)
+{
+    SwapRoaches(rx, --activeRoaches);
+    SwapRoaches(activeRoaches, --wakingEnd);
+    roaches.hiddenAt[wakingEnd] = (int) roachTick;
+    LinkSleeper(wakingEnd);
+}
+
+/*
+   File sleeping roach rx under its cover cell.
+*/
+static void LinkSleeper(int rx)
+{
+    int cx;
+    int cy;
+
+    cx = (roaches.x[rx] >> ROACH_FIX_SHIFT) >> COVER_SHIFT;
+    cy = (roaches.y[rx] >> ROACH_FIX_SHIFT) >> COVER_SHIFT;
+    cx = cx < 0 ? 0 : cx >= coverCols ? coverCols - 1 : cx;
+    cy = cy < 0 ? 0 : cy >= coverRows ? coverRows - 1 : cy;
+
+    sleepCell[rx] = cy * coverCols + cx;
+    sleepPrev[rx] = -1;
+    sleepNext[rx] = sleepHead[sleepCell[rx]];
+
+    if (sleepNext[rx] >= 0)
+        sleepPrev[sleepNext[rx]] = rx;
+
+    sleepHead[sleepCell[rx]] = rx;
+}
+
+/*
+   Take roach rx out of the sleeper lists.
+*/
+static void UnlinkSleeper(int rx)
+{
+    if (sleepPrev[rx] >= 0)
+        sleepNext[sleepPrev[rx]] = sleepNext[rx];
+    else
+        sleepHead[sleepCell[rx]] = sleepNext[rx];
+
+    if (sleepNext[rx] >= 0)
+        sleepPrev[sleepNext[rx]] = sleepPrev[rx];
+
+    sleepCell[rx] = -1;
+}
+
+/*
+   Roach rx has been uncovered.  If it is asleep, it joins the waking
+   roaches, and comes out once it has caught up.
+*/
+void ShowRoach(int rx)
+{
+    if (rx < activeRoaches)
+    {
+        roaches.flags[rx] &= ~ROACH_HIDDEN;
+    }
+    else if (rx >= wakingEnd)
+    {
+        UnlinkSleeper(rx);
+        SwapRoaches(rx, wakingEnd++);
+    }
+}
+
+static int CompareRoaches(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+/*
+   Wake the sleeping roaches that may overlap the rectangle and that
+   uncovered says have been.  Only the cover cells under the rectangle,
+   and those up and left of it by a roach, are looked at.  The roaches
+   are woken lowest first, as ShowRoach only ever moves a roach that has
+   been woken already into the place of the one it wakes.
+*/
+void ShowRoachesIn(int x, int y, int width, int height, int (*uncovered)(int rx))
+{
+    int nWake;
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+
+    if (width <= 0 || height <= 0 || wakingEnd == curRoaches)
+        return;
+
+    x1 = (x - gridCell) >> COVER_SHIFT;
+    y1 = (y - gridCell) >> COVER_SHIFT;
+    x2 = (x + width - 1) >> COVER_SHIFT;
+    y2 = (y + height - 1) >> COVER_SHIFT;
+    x1 = x1 < 0 ? 0 : x1;
+    y1 = y1 < 0 ? 0 : y1;
+    x2 = x2 >= coverCols ? coverCols - 1 : x2;
+    y2 = y2 >= coverRows ? coverRows - 1 : y2;
+    nWake = 0;
+
+    for (int cy = y1; cy <= y2; cy++)
+        for (int cx = x1; cx <= x2; cx++)
+            for (int rx = sleepHead[cy * coverCols + cx]; rx >= 0; rx = sleepNext[rx])
+                if (uncovered(rx))
+                    wakeList[nWake++] = rx;
+
+    qsort(wakeList, (size_t) nWake, sizeof(int), CompareRoaches);
+
+    for (int wx = 0; wx < nWake; wx++)
+        ShowRoach(wakeList[wx]);
+}
+
+/*
+   Everything has been uncovered; wake every roach.
+*/
+void ShowRoaches()
+{
+    for (int rx = 0; rx < activeRoaches; rx++)
+        roaches.flags[rx] &= ~ROACH_HIDDEN;
+
+    for (int rx = wakingEnd; rx < curRoaches; rx++)
+        sleepCell[rx] = -1;
+
+    memset(sleepHead, -1, sizeof(int) * coverCols * coverRows);
+    wakingEnd = curRoaches;
+}
+
+/*
+   Send the active roaches that have gone into hiding to sleep, once they
+   have been drawn for the last time.
+*/
+void HideRoaches()
+{
+    for (int rx = 0; rx < activeRoaches; )
+    {
+        if (roaches.flags[rx] & ROACH_HIDDEN)
+            SleepRoach(rx);
+        else
+            rx++;
+    }
+}
+
+/*
+   Number of uncovered roaches that are still to wake up.  They only do
+   so in MoveRoaches, so ticks must keep coming while there are any.
+*/
+int WakingRoaches()
+{
+    return wakingEnd - activeRoaches;
+}
+
+/*
+   Move a roach that has just woken up to where it would have got to had
+   it kept wandering in hiding.  It walks in straight runs, turning in
+   between as WalkRoach would, for at most CATCH_UP_RUNS runs; whatever
+   time is left after those it spent resting.
+*/
+static void CatchUpRoach(int rx)
+{
+    unsigned int ticks;
+    int          run;
+    int          maxX;
+    int          maxY;
+
+    ticks = roachTick - (unsigned int) roaches.hiddenAt[rx];
+
+    /* Nobody saw it turn. */
+    roaches.drawn[rx] = roaches.index[rx];
+
+    for (int jx = 0; jx < CATCH_UP_RUNS && ticks > 0; jx++)
+    {
+        run = roaches.steps[rx] + 1;
+
+        if ((unsigned int) run > ticks)
+            run = (int) ticks;
+
+        maxX = (int) (display_width - headingWidth[roaches.drawn[rx]]) << ROACH_FIX_SHIFT;
+        maxY = (int) (display_height - headingHeight[roaches.drawn[rx]]) << ROACH_FIX_SHIFT;
+        roaches.x[rx] += headingDX[roaches.drawn[rx]] * run;
+        roaches.y[rx] += headingDY[roaches.drawn[rx]] * run;
+
+        if (roaches.x[rx] < 0)
+            roaches.x[rx] = 0;
+        else if (roaches.x[rx] > maxX)
+            roaches.x[rx] = maxX;
+
+        if (roaches.y[rx] < 0)
+            roaches.y[rx] = 0;
+        else if (roaches.y[rx] > maxY)
+            roaches.y[rx] = maxY;
+
+        ticks -= (unsigned int) run;
+        roaches.steps[rx] -= run - 1;
+        WalkRoach(rx);
+        roaches.drawn[rx] = roaches.index[rx];
+    }
+
+    roaches.lastX[rx] = roaches.x[rx];
+    roaches.lastY[rx] = roaches.y[rx];
+}
+
+/*
+   Catch up with up to WAKE_BATCH waking roaches and let them join the
+   active ones, so that a large reveal is spread over several ticks.
+*/
+static void WakeRoaches()
+{
+    int end;
+
+    end = wakingEnd - activeRoaches > WAKE_BATCH ? activeRoaches + WAKE_BATCH : wakingEnd;
+
+    for (int rx = activeRoaches; rx < end; rx++)
+    {
+        CatchUpRoach(rx);
+        roaches.flags[rx] &= ~ROACH_HIDDEN;
+    }
+
+    activeRoaches = end;
+}
+
+/*
+   Settle a roach at its new position and orientation, once it has been
+   drawn there.  The position is roachLerp of the way from where the last
+   tick started to where it ended.
+*/
+void SettleRoach(int rx)
+{
+    int64_t lerp;
+    int     x;
+    int     y;
+
+    if (roachLerp >= 1.0f)
+    {
+        x = roaches.x[rx] >> ROACH_FIX_SHIFT;
+        y = roaches.y[rx] >> ROACH_FIX_SHIFT;
+    }
+    else
+    {
+        lerp = (int64_t) (roachLerp * ROACH_FIX_ONE);
+        x = (roaches.lastX[rx] + (int) (((roaches.x[rx] - roaches.lastX[rx]) * lerp) >> ROACH_FIX_SHIFT)) >> ROACH_FIX_SHIFT;
+        y = (roaches.lastY[rx] + (int) (((roaches.y[rx] - roaches.lastY[rx]) * lerp) >> ROACH_FIX_SHIFT)) >> ROACH_FIX_SHIFT;
+    }
+
+    /* Drawn in between ticks, a roach moves without MoveRoaches knowing. */
+    if (x != roaches.intX[rx] || y != roaches.intY[rx])
+    {
+        roaches.intX[rx] = x;
+        roaches.intY[rx] = y;
+        gridValid = 0;
+    }
+
+    roaches.drawn[rx] = roaches.index[rx];
+}
+
+/*
+   Rebuild the cover field from coverCells.  A cell is deep in cover if it
+   and its eight neighbours are covered, so a roach centred anywhere in it
+   is hidden; off screen counts as covered, since roaches never go there.
+   A breadth first search out of those cells finds the nearest one for
+   every other cell, and the heading to it is worked out once here rather
+   than on every turn.
+*/
+void BuildCoverField()
+{
+    int    nCells;
+    int    head;
+    int    tail;
+    int    cell;
+    int    cx;
+    int    cy;
+    int    nx;
+    int    ny;
+    int    deep;
+    double angle;
+
+    nCells = coverCols * coverRows;
+    tail = 0;
+
+    for (cy = 0; cy < coverRows; cy++)
+    {
+        for (cx = 0; cx < coverCols; cx++)
+        {
+            deep = 1;
+
+            for (ny = cy - 1; ny <= cy + 1 && deep; ny++)
+                for (nx = cx - 1; nx <= cx + 1 && deep; nx++)
+                    if (nx >= 0 && nx < coverCols && ny >= 0 && ny < coverRows)
+                        deep = coverCells[ny * coverCols + nx] != 0;
+
+            cell = cy * coverCols + cx;
+            coverNearest[cell] = deep ? cell : -1;
+
+            if (deep)
+                coverQueue[tail++] = cell;
+        }
+    }
+
+    for (head = 0; head < tail; head++)
+    {
+        cell = coverQueue[head];
+        cx = cell % coverCols;
+        cy = cell / coverCols;
+
+        for (ny = cy - 1; ny <= cy + 1; ny++)
+        {
+            for (nx = cx - 1; nx <= cx + 1; nx++)
+            {
+                if (nx < 0 || nx >= coverCols || ny < 0 || ny >= coverRows ||
+                    coverNearest[ny * coverCols + nx] >= 0)
+                    continue;
+
+                coverNearest[ny * coverCols + nx] = coverNearest[cell];
+                coverQueue[tail++] = ny * coverCols + nx;
+            }
+        }
+    }
+
+    for (cell = 0; cell < nCells; cell++)
+    {
+        if (coverNearest[cell] < 0 || coverNearest[cell] == cell)
+        {
+            coverHeading[cell] = -1;
+            continue;
+        }
+
+        /* Headings go anticlockwise from east, with y pointing down. */
+        angle = atan2((double) (cell / coverCols - coverNearest[cell] / coverCols),
+                      (double) (coverNearest[cell] % coverCols - cell % coverCols));
+        coverHeading[cell] = (signed char) ((lround(angle / (ROACH_ANGLE * M_PI / 180)) + ROACH_HEADINGS) % ROACH_HEADINGS);
+    }
+}
+
+/*
+   FNV-1a hash of the state of every roach, to tell whether two runs ended
+   up in the same place.
+*/
+uint32_t RoachChecksum()
+{
+    uint32_t      hash = 2166136261u;
+    unsigned char *bytes;
+    size_t        size;
+    void          *arrays[] = {roaches.x, roaches.y, roaches.intX, roaches.intY,
+                               roaches.index, roaches.drawn, roaches.steps, roaches.flags};
+
+    size = sizeof(int) * curRoaches;
+
+    for (int ax = 0; ax < (int) (sizeof(arrays) / sizeof(arrays[0])); ax++)
+    {
+        bytes = (unsigned char *) arrays[ax];
+
+        for (size_t bx = 0; bx < size; bx++)
+            hash = (hash ^ bytes[bx]) * 16777619u;
+    }
+
+    return hash;
+}
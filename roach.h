@@ -0,0 +1,147 @@
+/*
+    Roach simulation core.
+
+    Everything in here works without an X server: roach storage, turning
+    and moving.  xroach drives it from its event loop, xroach_bench drives
+    it from a plain loop.
+*/
+
+#ifndef ROACH_H
+#define ROACH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROACH_HEADINGS 24    /* number of orientations */
+#define ROACH_ANGLE    15    /* angle between orientations */
+
+#define ROACH_FIX_SHIFT 16   /* fraction bits of roach positions */
+#define ROACH_FIX_ONE  (1 << ROACH_FIX_SHIFT)
+
+#define ROACH_ALIGN    32    /* alignment of the roach arrays, in bytes */
+#define ROACH_CHUNK    4096  /* roaches per unit of work and of pool growth */
+#define SPAWN_START    2     /* roaches an infestation starts from, if they breed */
+#define WAKE_BATCH     4096  /* hidden roaches woken up per tick, at most */
+#define CATCH_UP_RUNS  8     /* straight runs a waking roach catches up with */
+
+/* Ways of keeping roaches from running into each other. */
+#define COLLIDE_NONE    0
+#define COLLIDE_GRID    1    /* spatial hash, near linear */
+#define COLLIDE_BRUTE   2    /* check every pair, for comparison only */
+
+/*
+   Roaches head for cover through a field of COVER_SHIFT sized cells;
+   COVER_BIAS is the percentage of turns that follow it.
+*/
+#define COVER_SHIFT     5    /* cover cells are 32x32 pixels */
+#define COVER_BIAS      75
+
+/* Roach flags. */
+#define ROACH_HIDDEN    0x01
+#define ROACH_TURN_LEFT 0x02
+
+typedef struct RoachMap {
+    char *roachBits;
+    int atlasX;             /* where the sprite sits in the atlas bitmap */
+    int width;
+    int height;
+    float sine;
+    float cosine;
+} RoachMap;
+
+/*
+   Roaches are stored as a structure of arrays, so the move kernel can
+   stream through positions without touching anything else.  Roach rx is
+   made up of element rx of every array.  index is the heading the roach is
+   turning to, drawn the heading it was last drawn at.  lastX and lastY are
+   where the roach was before the last tick, for drawing in between ticks.
+   rng is the state of the random number stream of the roach.  x, y, lastX
+   and lastY are fixed point, with ROACH_FIX_SHIFT bits of fraction, so
+   moving is all integer adds; intX and intY are whole pixels.
+
+   The first activeRoaches roaches are the ones out in the open, and the
+   only ones the per-frame loops look at.  Roaches that go into hiding get
+   the ROACH_HIDDEN flag, are drawn one last time to take them off the
+   screen, and are then moved past the active ones by HideRoaches.  The
+   hidden roaches are not drawn, so their intX is -1.
+
+   Hidden roaches do not move.  hiddenAt is the tick a roach went into
+   hiding, and when it is uncovered it makes up for the time in a few long
+   strides before it joins the active ones, up to WAKE_BATCH a tick.
+*/
+typedef struct Roaches
+{
+    int      *x;
+    int      *y;
+    int      *intX;
+    int      *intY;
+    int      *index;
+    int      *drawn;
+    int      *steps;
+    int      *flags;
+    int      *lastX;
+    int      *lastY;
+    int      *hiddenAt;
+    uint64_t *rng;
+} Roaches;
+
+extern RoachMap     roachPix[];
+extern Roaches      roaches;
+extern int          maxRoaches;
+extern int          curRoaches;
+extern int          activeRoaches;
+extern float        roachSpeed;
+extern float        turnSpeed;
+extern float        roachLerp;
+extern float        roachSpawn;
+extern unsigned int display_height;
+extern unsigned int display_width;
+extern int          collisionMode;
+extern int          roachThreads;
+extern int          coverSeeking;
+
+/*
+   Cover cells, coverCols by coverRows of them, set by the caller to
+   nonzero where no part of the cell is visible.  BuildCoverField turns
+   them into the headings the roaches follow.
+*/
+extern unsigned char *coverCells;
+extern int           coverCols;
+extern int           coverRows;
+
+/* Per-heading fixed point step and sprite size, filled in by InitRoaches. */
+extern int headingDX[ROACH_HEADINGS];
+extern int headingDY[ROACH_HEADINGS];
+extern int headingWidth[ROACH_HEADINGS];
+extern int headingHeight[ROACH_HEADINGS];
+
+/* Allocation counters, reported by xroach_bench. */
+extern long   roachAllocs;
+extern size_t roachAllocBytes;
+
+int InitRoaches();
+void FreeRoaches();
+void SeedRoaches(uint64_t seed);
+int RandInt(int maxVal);
+int RoachInRect(int roach, int rx, int ry, int x, int y, unsigned int width, unsigned int height);
+int RoachOverRect(int roach, int rx, int ry, int x, int y, unsigned int width, unsigned int height);
+int AddRoach();
+int AddRoaches(int count);
+int BreedRoach();
+void CopyRoach(int to, int from);
+void TurnRoach(int rx);
+void MoveRoach(int rx);
+void MoveRoaches();
+void SettleRoach(int rx);
+int RoachesAt(int x, int y, int exact, int *hits, int maxHits);
+void RemoveRoach(int rx);
+void ShowRoach(int rx);
+void ShowRoachesIn(int x, int y, int width, int height, int (*uncovered)(int rx));
+void ShowRoaches();
+void HideRoaches();
+int WakingRoaches();
+int ForEachChunk(int (*work)(int from, int to));
+void BuildCoverField();
+uint32_t RoachChecksum();
+
+#endif /* ROACH_H */
@@ -0,0 +1,155 @@
+/*
+    Run time counters for xroach.
+
+    Copyright 1991 by J.T. Anderson
+
+    jta@locus.com
+
+    This program may be freely distributed provided that all
+    copyright notices are retained.
+*/
+
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+Stats stats;
+
+static double intervalStart;
+
+/*
+   Clear the counters and start an interval at now, in microseconds on the
+   monotonic clock.  The roach counts are left alone.
+*/
+void StartStats(double now)
+{
+    stats.frames = 0;
+    stats.ticks = 0;
+    stats.simUsec = 0;
+    stats.renderUsec = 0;
+    stats.calcCalls = 0;
+    stats.calcUsec = 0;
+    stats.exposes = 0;
+    stats.requests = 0;
+    stats.maxRequests = 0;
+    memset(stats.frameTimes, 0, sizeof(stats.frameTimes));
+    intervalStart = now;
+}
+
+/*
+   Histogram bucket for a time in microseconds.  Below 8 every microsecond
+   has its own bucket; above, each power of two is split into 8, so a
+   bucket is never more than an eighth off.
+*/
+static int TimeBucket(double usec)
+{
+    unsigned long value;
+    int           msb;
+
+    value = usec > 0 ? (unsigned long) usec : 0;
+
+    if (value < 8)
+        return (int) value;
+
+    for (msb = 3; msb < 63 && (value >> (msb + 1)) != 0; msb++)
+        ;
+
+    if ((msb - 2) * 8 + 7 >= STATS_BUCKETS)
+        return STATS_BUCKETS - 1;
+
+    return (msb - 2) * 8 + (int) ((value >> (msb - 3)) & 7);
+}
+
+/*
+   Smallest time in microseconds that falls in bucket.
+*/
+static double BucketStart(int bucket)
+{
+    if (bucket < 8)
+        return bucket;
+
+    return (double) ((8UL + (unsigned long) (bucket & 7)) << (bucket / 8 - 1));
+}
+
+/*
+   Count a frame that took usec microseconds and sent requests requests.
+*/
+void CountFrame(double usec, unsigned long requests)
+{
+    stats.frames++;
+    stats.frameTimes[TimeBucket(usec)]++;
+    stats.requests += requests;
+
+    if (requests > stats.maxRequests)
+        stats.maxRequests = requests;
+}
+
+/*
+   Frame time in milliseconds that the given fraction of the frames of
+   this interval stayed under, to the resolution of the histogram.
+*/
+double FramePercentile(double fraction)
+{
+    long rank;
+    long seen;
+
+    if (stats.frames == 0)
+        return 0;
+
+    rank = (long) (fraction * stats.frames + 0.5);
+
+    if (rank < 1)
+        rank = 1;
+
+    seen = 0;
+
+    for (int bx = 0; bx < STATS_BUCKETS; bx++)
+    {
+        seen += stats.frameTimes[bx];
+
+        if (seen >= rank)
+            return BucketStart(bx + 1) / 1e3;
+    }
+
+    return BucketStart(STATS_BUCKETS) / 1e3;
+}
+
+/*
+   Write the counters of the interval that ends at now as one line of JSON
+   and start the next interval.  The roach counts are as of the last frame.
+*/
+void WriteStats(FILE *out, double now)
+{
+    double interval;
+
+    interval = now - intervalStart;
+
+    fprintf(out,
+            "{\"time\":%ld,\"interval_ms\":%.1f,"
+            "\"frames\":%ld,\"fps\":%.1f,\"frame_p50_ms\":%.3f,\"frame_p99_ms\":%.3f,"
+            "\"ticks\":%ld,\"sim_ms\":%.3f,\"render_ms\":%.3f,"
+            "\"calc_calls\":%ld,\"calc_ms\":%.3f,\"exposes\":%ld,"
+            "\"requests\":%lu,\"requests_per_frame\":%.1f,\"max_requests_per_frame\":%lu,"
+            "\"visible\":%d,\"hidden\":%d}\n",
+            (long) time((time_t *) NULL),
+            interval / 1e3,
+            stats.frames,
+            interval > 0 ? stats.frames * 1e6 / interval : 0.0,
+            FramePercentile(0.50),
+            FramePercentile(0.99),
+            stats.ticks,
+            stats.simUsec / 1e3,
+            stats.renderUsec / 1e3,
+            stats.calcCalls,
+            stats.calcUsec / 1e3,
+            stats.exposes,
+            stats.requests,
+            stats.frames ? (double) stats.requests / stats.frames : 0.0,
+            stats.maxRequests,
+            stats.visible,
+            stats.hidden);
+    fflush(out);
+
+    StartStats(now);
+}
@@ -0,0 +1,41 @@
+/*
+    Run time counters for xroach.
+
+    Counts frames, simulation ticks, time spent and requests sent, and keeps
+    a histogram of frame times.  WriteStats dumps them as one JSON line and
+    starts a new interval, so every line covers the time since the one
+    before it.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/* Frame time histogram: 8 buckets per power of two microseconds. */
+#define STATS_BUCKETS 256
+
+typedef struct Stats
+{
+    long          frames;
+    long          ticks;
+    double        simUsec;
+    double        renderUsec;
+    long          calcCalls;
+    double        calcUsec;
+    long          exposes;
+    unsigned long requests;
+    unsigned long maxRequests;        /* most requests in one frame */
+    int           visible;
+    int           hidden;
+    long          frameTimes[STATS_BUCKETS];
+} Stats;
+
+extern Stats stats;
+
+void StartStats(double now);
+void CountFrame(double usec, unsigned long requests);
+double FramePercentile(double fraction);
+void WriteStats(FILE *out, double now);
+
+#endif /* STATS_H */
@@ -0,0 +1,403 @@
+/*
+    Record and replay of xroach sessions.
+
+    Copyright 1991 by J.T. Anderson
+
+    jta@locus.com
+
+    This program may be freely distributed provided that all
+    copyright notices are retained.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "roach.h"
+#include "visible.h"
+#include "trace.h"
+
+#define TRACE_BUFFER (1 << 20)    /* stdio buffer of the trace being written */
+#define SQUISH_HITS  64
+
+static FILE *traceFile = NULL;
+
+/*
+   Time spent in the parts of a replay, in nanoseconds.
+*/
+static double moveTime;
+static double resetTime;
+static double markTime;
+
+static double Now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+   Start writing a trace of this session to path.  Must be called once the
+   screen size is known, before any roach is born.  Returns 0 on failure.
+*/
+int StartRecording(const char *path, uint64_t seed, int exact)
+{
+    TraceHeader header;
+
+    traceFile = fopen(path, "wb");
+
+    if (traceFile == NULL)
+        return 0;
+
+    setvbuf(traceFile, NULL, _IOFBF, TRACE_BUFFER);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.seed = seed;
+    header.width = display_width;
+    header.height = display_height;
+    header.roaches = maxRoaches;
+    header.speed = roachSpeed;
+    header.collide = collisionMode;
+    header.exact = exact;
+    header.cover = coverSeeking;
+    header.spawn = roachSpawn;
+
+    return fwrite(&header, sizeof(header), 1, traceFile) == 1;
+}
+
+void StopRecording()
+{
+    if (traceFile != NULL)
+        fclose(traceFile);
+
+    traceFile = NULL;
+}
+
+static void WriteRecord(TraceRecord *rec)
+{
+    if (traceFile != NULL)
+        fwrite(rec, sizeof(*rec), 1, traceFile);
+}
+
+/*
+   Hand a window change to the visible region code.
+*/
+static void ApplyEvent(const TraceRecord *rec)
+{
+    switch (rec->type)
+    {
+        case TRACE_SCAN:
+            ClearWindows();
+            break;
+
+        case TRACE_WINDOW:
+            SetWindow((Window) rec->window, rec->x, rec->y, rec->width, rec->height,
+                      rec->border, rec->arg, rec->value);
+            break;
+
+        case TRACE_RESET:
+            ResetVisible();
+            break;
+
+        case TRACE_CREATE:
+            WindowCreated((Window) rec->window, rec->x, rec->y, rec->width, rec->height, rec->border);
+            break;
+
+        case TRACE_DESTROY:
+            WindowDestroyed((Window) rec->window);
+            break;
+
+        case TRACE_CONFIGURE:
+            WindowConfigured((Window) rec->window, rec->x, rec->y, rec->width, rec->height, rec->border);
+            break;
+
+        case TRACE_MOVE:
+            WindowMoved((Window) rec->window, rec->x, rec->y);
+            break;
+
+        case TRACE_MAP:
+            WindowMapped((Window) rec->window, rec->value);
+            break;
+
+        case TRACE_UNMAP:
+            WindowUnmapped((Window) rec->window);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+   Record a window change, one of TRACE_SCAN to TRACE_UNMAP, and hand it to
+   the visible region code.  Arguments a change has no use for are 0.
+*/
+void TraceEvent(int type, Window id, int x, int y, int width, int height, int border, int arg, int value)
+{
+    TraceRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.window = (uint64_t) id;
+    rec.x = x;
+    rec.y = y;
+    rec.width = width;
+    rec.height = height;
+    rec.border = border;
+    rec.arg = arg;
+    rec.value = value;
+
+    WriteRecord(&rec);
+    ApplyEvent(&rec);
+}
+
+/*
+   Record and mark the roaches that have gone under a window.  Returns the
+   number still visible.
+*/
+int TraceMarkHidden()
+{
+    TraceRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = TRACE_MARK;
+    WriteRecord(&rec);
+
+    return MarkHiddenRoaches();
+}
+
+/*
+   Record a frame that ran ticks ticks before drawing at roachLerp.
+*/
+void TraceFrame(int ticks)
+{
+    TraceRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = TRACE_FRAME;
+    rec.arg = ticks;
+    memcpy(&rec.value, &roachLerp, sizeof(rec.value));
+    WriteRecord(&rec);
+}
+
+void TraceSquish(int x, int y)
+{
+    TraceRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = TRACE_SQUISH;
+    rec.x = x;
+    rec.y = y;
+    WriteRecord(&rec);
+}
+
+/*
+   Record a checksum of the roach state, for the replay to check against.
+*/
+void TraceCheckpoint()
+{
+    TraceRecord rec;
+
+    if (traceFile == NULL)
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = TRACE_CHECK;
+    rec.arg = curRoaches;
+    rec.window = RoachChecksum();
+    WriteRecord(&rec);
+}
+
+/*
+   Do what drawing a frame does to the roach state: settle the visible
+   roaches, forget where the hidden ones were and move them out of the
+   active ones.
+*/
+static void SettleRoaches()
+{
+    for (int rx = 0; rx < activeRoaches; rx++)
+    {
+        if (roaches.flags[rx] & ROACH_HIDDEN)
+            roaches.intX[rx] = -1;
+        else
+            SettleRoach(rx);
+    }
+
+    HideRoaches();
+}
+
+/*
+   Replay one record.  Returns 0 if a checksum does not match.
+*/
+static int ReplayRecord(const TraceRecord *rec, int exact)
+{
+    int    hits[SQUISH_HITS];
+    int    nHits;
+    double start;
+
+    start = Now();
+
+    switch (rec->type)
+    {
+        case TRACE_MARK:
+            MarkHiddenRoaches();
+            markTime += Now() - start;
+            break;
+
+        case TRACE_FRAME:
+            for (int tx = 0; tx < rec->arg; tx++)
+                MoveRoaches();
+
+            moveTime += Now() - start;
+            memcpy(&roachLerp, &rec->value, sizeof(roachLerp));
+            SettleRoaches();
+            break;
+
+        case TRACE_SQUISH:
+            do
+            {
+                nHits = RoachesAt(rec->x, rec->y, exact, hits, SQUISH_HITS);
+
+                for (int hx = 0; hx < nHits; hx++)
+                    RemoveRoach(hits[hx]);
+            } while (nHits == SQUISH_HITS);
+            break;
+
+        case TRACE_CHECK:
+            return rec->arg == curRoaches && (uint32_t) rec->window == RoachChecksum();
+
+        default:
+            ApplyEvent(rec);
+
+            if (rec->type == TRACE_RESET)
+                resetTime += Now() - start;
+            break;
+    }
+
+    return 1;
+}
+
+/*
+   Replay the trace in path as fast as possible and report where the time
+   went.  The trace is mapped rather than read, so it can be far larger
+   than memory.  Returns the exit status: 0 if every checksum matched.
+*/
+int ReplayTrace(const char *path)
+{
+    TraceHeader       header;
+    const TraceRecord *records;
+    struct stat       st;
+    char              *map;
+    double            start;
+    double            elapsed;
+    size_t            nRecords;
+    long              frames;
+    long              ticks;
+    long              checks;
+    long              mismatches;
+    int               fd;
+
+    fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(header))
+    {
+        fprintf(stderr, "xroach: cannot read trace %s\n", path);
+        return 1;
+    }
+
+    map = (char *) mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "xroach: cannot map trace %s\n", path);
+        return 1;
+    }
+
+    posix_madvise(map, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL);
+    memcpy(&header, map, sizeof(header));
+
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "xroach: %s is not an xroach trace\n", path);
+        munmap(map, (size_t) st.st_size);
+        return 1;
+    }
+
+    records = (const TraceRecord *) (map + sizeof(header));
+    nRecords = ((size_t) st.st_size - sizeof(header)) / sizeof(TraceRecord);
+
+    SeedRoaches(header.seed);
+    display_width = header.width;
+    display_height = header.height;
+    maxRoaches = header.roaches;
+    roachSpeed = header.speed;
+    collisionMode = header.collide;
+    coverSeeking = header.cover;
+    roachSpawn = header.spawn;
+
+    if (!InitRoaches())
+    {
+        fprintf(stderr, "xroach: cannot allocate %d roaches\n", maxRoaches);
+        munmap(map, (size_t) st.st_size);
+        return 1;
+    }
+
+    if (!AddRoaches(roachSpawn > 0 ? SPAWN_START : maxRoaches))
+    {
+        fprintf(stderr, "xroach: cannot allocate %d roaches\n", maxRoaches);
+        munmap(map, (size_t) st.st_size);
+        return 1;
+    }
+
+    frames = 0;
+    ticks = 0;
+    checks = 0;
+    mismatches = 0;
+    moveTime = 0;
+    resetTime = 0;
+    markTime = 0;
+    start = Now();
+
+    for (size_t rx = 0; rx < nRecords; rx++)
+    {
+        if (records[rx].type == TRACE_FRAME)
+        {
+            frames++;
+            ticks += records[rx].arg;
+        }
+        else if (records[rx].type == TRACE_CHECK)
+        {
+            checks++;
+        }
+
+        if (!ReplayRecord(&records[rx], header.exact))
+        {
+            if (mismatches++ == 0)
+                fprintf(stderr, "xroach: roach state differs from the trace at record %zu\n", rx);
+        }
+    }
+
+    elapsed = Now() - start;
+
+    printf("records %zu, frames %ld, ticks %ld, %.1f ms (%.0f records/s)\n",
+           nRecords, frames, ticks, elapsed / 1e6, nRecords * 1e9 / elapsed);
+    printf("move %.1f ms, visible region %.1f ms, hidden test %.1f ms\n",
+           moveTime / 1e6, resetTime / 1e6, markTime / 1e6);
+    printf("checkpoints %ld, mismatches %ld\n", checks, mismatches);
+
+    FreeRoaches();
+    munmap(map, (size_t) st.st_size);
+
+    return mismatches != 0;
+}
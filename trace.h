@@ -0,0 +1,79 @@
+/*
+    Record and replay of xroach sessions.
+
+    A trace starts with a TraceHeader, which has everything needed to set
+    up the same roaches again, followed by fixed size TraceRecords: the
+    window changes fed to the visible region code, the frames with the
+    number of ticks they ran, squish clicks, and checksums of the roach
+    state every so often.  Replaying runs the simulation and visibility
+    code from the records alone, without an X server, and checks the
+    checksums on the way.  Traces are in the byte order of the machine
+    that wrote them.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <X11/Xlib.h>
+
+#define TRACE_MAGIC     "XROACHT2"
+
+/* Record types. */
+#define TRACE_SCAN      1    /* full scan of the window tree starts */
+#define TRACE_WINDOW    2    /* window found by the scan */
+#define TRACE_RESET     3    /* scan done, visible region rebuilt */
+#define TRACE_CREATE    4
+#define TRACE_DESTROY   5
+#define TRACE_CONFIGURE 6
+#define TRACE_MOVE      7
+#define TRACE_MAP       8
+#define TRACE_UNMAP     9
+#define TRACE_MARK      10   /* roaches under windows marked hidden */
+#define TRACE_FRAME     11   /* ticks run and roaches drawn */
+#define TRACE_SQUISH    12   /* click at x, y */
+#define TRACE_CHECK     13   /* checksum of the roach state */
+
+typedef struct TraceHeader
+{
+    char     magic[8];
+    uint64_t seed;
+    uint32_t width;
+    uint32_t height;
+    int32_t  roaches;
+    float    speed;
+    int32_t  collide;
+    int32_t  exact;
+    int32_t  cover;
+    float    spawn;     /* roaches bred a tick */
+} TraceHeader;
+
+/*
+   One record.  arg is the mapped flag of TRACE_WINDOW, the number of
+   ticks of TRACE_FRAME and the number of roaches of TRACE_CHECK; value is
+   the window kind of TRACE_WINDOW and TRACE_MAP and the bits of roachLerp
+   of TRACE_FRAME.  TRACE_CHECK keeps its checksum in window.
+*/
+typedef struct TraceRecord
+{
+    uint64_t window;
+    int32_t  type;
+    int32_t  x;
+    int32_t  y;
+    int32_t  width;
+    int32_t  height;
+    int32_t  border;
+    int32_t  arg;
+    int32_t  value;
+} TraceRecord;
+
+int StartRecording(const char *path, uint64_t seed, int exact);
+void StopRecording();
+void TraceEvent(int type, Window id, int x, int y, int width, int height, int border, int arg, int value);
+int TraceMarkHidden();
+void TraceFrame(int ticks);
+void TraceSquish(int x, int y);
+void TraceCheckpoint();
+int ReplayTrace(const char *path);
+
+#endif /* TRACE_H */
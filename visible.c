@@ -0,0 +1,759 @@
+/*
+    Visible region of the root window for xroach.
+
+    Copyright 1991 by J.T. Anderson
+
+    jta@locus.com
+
+    This program may be freely distributed provided that all
+    copyright notices are retained.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "roach.h"
+#include "visible.h"
+
+#include <X11/Xregion.h>
+
+/* A window ID can never have its top bits set. */
+#define DELETED_WINDOW ((Window) ~0UL)
+
+/* The visible region is also kept as a bitmap of 8x8 pixel cells. */
+#define CELL_SHIFT     3
+
+typedef struct WinRect
+{
+    Window     id;
+    XRectangle rect;    /* including the border */
+    int        mapped;
+    int        kind;
+} WinRect;
+
+Region rootVisible = NULL;
+
+/*
+   Bit cx of row cy is set if any pixel of cell (cx, cy) is visible.  A
+   roach whose cells are all clear is certainly hidden, which is what
+   MarkHiddenRoaches needs; near window edges it may be called visible a
+   few pixels early, never hidden too soon.
+*/
+static uint64_t *visibleCells = NULL;
+static int      cellsX        = 0;
+static int      cellsY        = 0;
+static int      cellWords     = 0;    /* words per row */
+static int      coverStale    = 1;    /* cover field needs rebuilding */
+
+/* What UncoverRect or ResetVisible is uncovering, for RoachUncovered. */
+static Region     uncoverPatch = NULL;
+static XRectangle uncoverBox;
+
+static WinRect *windows    = NULL;
+static int     windowSlots = 0;     /* always a power of two */
+static int     windowsUsed = 0;     /* live and deleted slots */
+
+/*
+   Hash a window ID to a slot.
+*/
+static int WindowSlot(Window id)
+{
+    unsigned long hash;
+
+    hash = (unsigned long) id;
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bUL;
+    hash ^= hash >> 16;
+
+    return (int) (hash & (unsigned long) (windowSlots - 1));
+}
+
+/*
+   Look up the rectangle of a window.  Returns NULL if it is unknown.
+*/
+static WinRect *FindWindowRect(Window id)
+{
+    if (windowSlots == 0)
+        return NULL;
+
+    for (int sx = WindowSlot(id); windows[sx].id != None; sx = (sx + 1) & (windowSlots - 1))
+        if (windows[sx].id == id)
+            return &windows[sx];
+
+    return NULL;
+}
+
+/*
+   Look up the rectangle of a window, adding an empty unmapped one if it is
+   unknown.  The table is doubled whenever it gets half full.  If it cannot
+   grow it is filled up further, and once it is full NULL is returned and
+   the window is not tracked: roaches then run over it as if it were not
+   there, which is better than hiding them under nothing.
+*/
+static WinRect *InsertWindowRect(Window id)
+{
+    int     newSlots;
+    int     oldSlots;
+    int     sx;
+    WinRect *found;
+    WinRect *grown;
+    WinRect *oldWindows;
+    WinRect *reuse;
+
+    found = FindWindowRect(id);
+
+    if (found != NULL)
+        return found;
+
+    grown = NULL;
+    newSlots = windowSlots ? windowSlots * 2 : 64;
+
+    if ((windowsUsed + 1) * 2 > windowSlots)
+        grown = (WinRect *) calloc((size_t) newSlots, sizeof(WinRect));
+
+    if ((windowsUsed + 1) * 2 > windowSlots && grown == NULL)
+    {
+        fprintf(stderr, "xroach: cannot grow the window table to %d windows\n", newSlots);
+
+        /* Probing needs at least one empty slot left over. */
+        if (windowsUsed + 2 > windowSlots)
+            return NULL;
+    }
+
+    if (grown != NULL)
+    {
+        oldWindows = windows;
+        oldSlots = windowSlots;
+
+        windows = grown;
+        windowSlots = newSlots;
+        windowsUsed = 0;
+
+        for (int ox = 0; ox < oldSlots; ox++)
+        {
+            if (oldWindows[ox].id == None || oldWindows[ox].id == DELETED_WINDOW)
+                continue;
+
+            for (sx = WindowSlot(oldWindows[ox].id); windows[sx].id != None; sx = (sx + 1) & (windowSlots - 1))
+                ;
+
+            windows[sx] = oldWindows[ox];
+            windowsUsed++;
+        }
+
+        free(oldWindows);
+    }
+
+    reuse = NULL;
+
+    for (sx = WindowSlot(id); windows[sx].id != None; sx = (sx + 1) & (windowSlots - 1))
+        if (reuse == NULL && windows[sx].id == DELETED_WINDOW)
+            reuse = &windows[sx];
+
+    if (reuse == NULL)
+    {
+        reuse = &windows[sx];
+        windowsUsed++;
+    }
+
+    reuse->id = id;
+    reuse->rect.x = 0;
+    reuse->rect.y = 0;
+    reuse->rect.width = 0;
+    reuse->rect.height = 0;
+    reuse->mapped = 0;
+    reuse->kind = WINDOW_UNKNOWN;
+
+    return reuse;
+}
+
+/*
+   Does the window hide whatever is below it?
+*/
+static int Covers(WinRect *w)
+{
+    return w->mapped && w->kind == WINDOW_INPUT_OUTPUT;
+}
+
+static int RectsOverlap(XRectangle *a, XRectangle *b)
+{
+    return a->x < b->x + b->width && b->x < a->x + a->width &&
+           a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+static Region RectRegion(XRectangle *rect)
+{
+    Region region;
+
+    region = XCreateRegion();
+    XUnionRectWithRegion(rect, region, region);
+
+    return region;
+}
+
+/*
+   Mask of bits lo to hi of a word, both included.
+*/
+static uint64_t BitRange(int lo, int hi)
+{
+    return (~(uint64_t) 0 >> (63 - hi)) & (~(uint64_t) 0 << lo);
+}
+
+/*
+   Redraw the cell bitmap from the visible region, inside the given pixel
+   rectangle only.  The rectangle is widened to whole cells first, so every
+   region box touching a redrawn cell is taken into account.
+*/
+static void RasterizeCells(int x1, int y1, int x2, int y2)
+{
+    int      cx1, cy1, cx2, cy2;
+    int      bx1, by1, bx2, by2;
+    BOX      *box;
+    uint64_t *row;
+
+    if (x1 < 0)
+        x1 = 0;
+
+    if (y1 < 0)
+        y1 = 0;
+
+    cx1 = x1 >> CELL_SHIFT;
+    cy1 = y1 >> CELL_SHIFT;
+    cx2 = (x2 - 1) >> CELL_SHIFT;
+    cy2 = (y2 - 1) >> CELL_SHIFT;
+
+    if (cx2 >= cellsX)
+        cx2 = cellsX - 1;
+
+    if (cy2 >= cellsY)
+        cy2 = cellsY - 1;
+
+    if (cx1 > cx2 || cy1 > cy2)
+        return;
+
+    coverStale = 1;
+
+    for (int cy = cy1; cy <= cy2; cy++)
+    {
+        row = &visibleCells[cy * cellWords];
+
+        for (int wx = cx1 >> 6; wx <= cx2 >> 6; wx++)
+            row[wx] &= ~BitRange(wx == cx1 >> 6 ? cx1 & 63 : 0,
+                                 wx == cx2 >> 6 ? cx2 & 63 : 63);
+    }
+
+    for (long bx = 0; bx < rootVisible->numRects; bx++)
+    {
+        box = &rootVisible->rects[bx];
+
+        /* Clip the box to the cells being redrawn. */
+        bx1 = box->x1 >> CELL_SHIFT;
+        by1 = box->y1 >> CELL_SHIFT;
+        bx2 = (box->x2 - 1) >> CELL_SHIFT;
+        by2 = (box->y2 - 1) >> CELL_SHIFT;
+
+        if (bx1 < cx1)
+            bx1 = cx1;
+
+        if (by1 < cy1)
+            by1 = cy1;
+
+        if (bx2 > cx2)
+            bx2 = cx2;
+
+        if (by2 > cy2)
+            by2 = cy2;
+
+        if (bx1 > bx2 || by1 > by2)
+            continue;
+
+        for (int cy = by1; cy <= by2; cy++)
+        {
+            row = &visibleCells[cy * cellWords];
+
+            for (int wx = bx1 >> 6; wx <= bx2 >> 6; wx++)
+                row[wx] |= BitRange(wx == bx1 >> 6 ? bx1 & 63 : 0,
+                                    wx == bx2 >> 6 ? bx2 & 63 : 63);
+        }
+    }
+}
+
+/*
+   Is any cell under the given pixel rectangle visible?  Roaches span at
+   most a handful of cells in each direction, so a cell row never touches
+   more than two words and costs a couple of word ANDs.
+*/
+static int CellsVisible(int x, int y, int width, int height)
+{
+    int      cx1, cy1, cx2, cy2;
+    int      w1, w2;
+    uint64_t *row;
+
+    cx1 = x >> CELL_SHIFT;
+    cy1 = y >> CELL_SHIFT;
+    cx2 = (x + width - 1) >> CELL_SHIFT;
+    cy2 = (y + height - 1) >> CELL_SHIFT;
+
+    if (cx1 < 0)
+        cx1 = 0;
+
+    if (cy1 < 0)
+        cy1 = 0;
+
+    if (cx2 >= cellsX)
+        cx2 = cellsX - 1;
+
+    if (cy2 >= cellsY)
+        cy2 = cellsY - 1;
+
+    w1 = cx1 >> 6;
+    w2 = cx2 >> 6;
+
+    for (int cy = cy1; cy <= cy2; cy++)
+    {
+        row = &visibleCells[cy * cellWords];
+
+        if (w1 == w2)
+        {
+            if (row[w1] & BitRange(cx1 & 63, cx2 & 63))
+                return 1;
+        }
+        else if ((row[w1] & BitRange(cx1 & 63, 63)) | (row[w2] & BitRange(0, cx2 & 63)))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+   A window now covers rect; take it out of the visible region.
+*/
+static void CoverRect(XRectangle *rect)
+{
+    Region covered;
+
+    covered = RectRegion(rect);
+    XSubtractRegion(rootVisible, covered, rootVisible);
+    XDestroyRegion(covered);
+
+    RasterizeCells(rect->x, rect->y, rect->x + rect->width, rect->y + rect->height);
+}
+
+/*
+   Whether roach rx is at least partly in patch, whose extents are box.
+   Most roaches are nowhere near the patch, and the box tells so without
+   going through the region.
+*/
+static int RoachInPatch(Region patch, XRectangle *box, int rx)
+{
+    int x;
+    int y;
+    int width;
+    int height;
+
+    x = roaches.x[rx] >> ROACH_FIX_SHIFT;
+    y = roaches.y[rx] >> ROACH_FIX_SHIFT;
+    width = headingWidth[roaches.drawn[rx]];
+    height = headingHeight[roaches.drawn[rx]];
+
+    if (x + width <= box->x || x >= box->x + box->width ||
+        y + height <= box->y || y >= box->y + box->height)
+        return 0;
+
+    return XRectInRegion(patch, x, y, (unsigned int) width, (unsigned int) height) != RectangleOut;
+}
+
+/*
+   Whether sleeping roach rx is in the patch being uncovered.
+*/
+static int RoachUncovered(int rx)
+{
+    return RoachInPatch(uncoverPatch, &uncoverBox, rx);
+}
+
+/*
+   A window no longer covers rect.  Whatever part of it no other window
+   covers becomes visible, and the roaches there start moving again.
+*/
+static void UncoverRect(XRectangle *rect)
+{
+    Region     patch;
+    Region     covered;
+    XRectangle screenRect;
+    XRectangle box;
+
+    screenRect.x = 0;
+    screenRect.y = 0;
+    screenRect.width = (unsigned short) display_width;
+    screenRect.height = (unsigned short) display_height;
+
+    patch = RectRegion(rect);
+    covered = RectRegion(&screenRect);
+    XIntersectRegion(patch, covered, patch);
+    XDestroyRegion(covered);
+
+    for (int sx = 0; sx < windowSlots; sx++)
+    {
+        if (windows[sx].id == None || windows[sx].id == DELETED_WINDOW)
+            continue;
+
+        if (Covers(&windows[sx]) && RectsOverlap(&windows[sx].rect, rect))
+        {
+            covered = RectRegion(&windows[sx].rect);
+            XSubtractRegion(patch, covered, patch);
+            XDestroyRegion(covered);
+        }
+    }
+
+    XUnionRegion(rootVisible, patch, rootVisible);
+    RasterizeCells(rect->x, rect->y, rect->x + rect->width, rect->y + rect->height);
+
+    XClipBox(patch, &box);
+
+    if (box.width == 0 || box.height == 0)
+    {
+        XDestroyRegion(patch);
+        return;
+    }
+
+    /*
+       Roaches just marked hidden and not yet drawn off the screen are
+       still among the active ones, which are looked at every frame anyway.
+    */
+    for (int rx = 0; rx < activeRoaches; rx++)
+        if ((roaches.flags[rx] & ROACH_HIDDEN) && RoachInPatch(patch, &box, rx))
+            ShowRoach(rx);
+
+    /*
+       The waking ones are coming out anyway, and the sleeping ones are
+       found through the cover cells under the patch.
+    */
+    uncoverPatch = patch;
+    uncoverBox = box;
+    ShowRoachesIn(box.x, box.y, box.width, box.height, RoachUncovered);
+
+    XDestroyRegion(patch);
+}
+
+/*
+   Patch the visible region after a window changed.  old is where it was,
+   wasCovering whether it covered anything there.
+*/
+static void PatchVisible(WinRect *w, XRectangle *old, int wasCovering)
+{
+    if (rootVisible == NULL)
+        return;
+
+    if (wasCovering)
+        UncoverRect(old);
+
+    if (w != NULL && Covers(w))
+        CoverRect(&w->rect);
+}
+
+/*
+   Forget all windows, before a full scan.
+*/
+void ClearWindows()
+{
+    free(windows);
+    windows = NULL;
+    windowSlots = 0;
+    windowsUsed = 0;
+}
+
+/*
+   Record a window found by a full scan.
+*/
+void SetWindow(Window id, int x, int y, int width, int height, int border, int mapped, int kind)
+{
+    WinRect *w;
+
+    w = InsertWindowRect(id);
+
+    if (w == NULL)
+        return;
+
+    w->rect.x = (short) x;
+    w->rect.y = (short) y;
+    w->rect.width = (unsigned short) (width + (border * 2));
+    w->rect.height = (unsigned short) (height + (border * 2));
+    w->mapped = mapped;
+    w->kind = kind;
+}
+
+/*
+   Kind of a window, WINDOW_UNKNOWN if it was created after the last scan
+   and has not been mapped yet.
+*/
+int WindowKind(Window id)
+{
+    WinRect *w;
+
+    w = FindWindowRect(id);
+
+    return w != NULL ? w->kind : WINDOW_UNKNOWN;
+}
+
+/*
+   Rebuild the visible region from all known windows, and wake the
+   roaches that are hiding where it is visible now.
+*/
+void ResetVisible()
+{
+    Region     covered;
+    XRectangle rect;
+    XRectangle box;
+    BOX        *visible;
+
+    covered = XCreateRegion();
+
+    for (int sx = 0; sx < windowSlots; sx++)
+    {
+        if (windows[sx].id == None || windows[sx].id == DELETED_WINDOW)
+            continue;
+
+        if (Covers(&windows[sx]))
+            XUnionRectWithRegion(&windows[sx].rect, covered, covered);
+    }
+
+    /*
+       Subtract the covered region from the root window region.
+    */
+    if (rootVisible)
+        XDestroyRegion(rootVisible);
+
+    rootVisible = XCreateRegion();
+
+    rect.x = 0;
+    rect.y = 0;
+
+    rect.width  = (unsigned short) display_width;
+    rect.height = (unsigned short) display_height;
+
+    XUnionRectWithRegion(&rect, rootVisible, rootVisible);
+    XSubtractRegion(rootVisible, covered, rootVisible);
+    XDestroyRegion(covered);
+
+    if (cellsX != (int) (display_width + (1 << CELL_SHIFT) - 1) >> CELL_SHIFT ||
+        cellsY != (int) (display_height + (1 << CELL_SHIFT) - 1) >> CELL_SHIFT)
+    {
+        cellsX = (int) (display_width + (1 << CELL_SHIFT) - 1) >> CELL_SHIFT;
+        cellsY = (int) (display_height + (1 << CELL_SHIFT) - 1) >> CELL_SHIFT;
+        cellWords = (cellsX + 63) / 64;
+
+        free(visibleCells);
+        visibleCells = (uint64_t *) malloc(sizeof(uint64_t) * cellWords * cellsY);
+    }
+
+    memset(visibleCells, 0, sizeof(uint64_t) * cellWords * cellsY);
+    RasterizeCells(0, 0, (int) display_width, (int) display_height);
+
+    /*
+       Waking every roach would bring out the covered ones too, all at
+       once.  Only those in the new region wake, found the way UncoverRect
+       finds them, one box of the region at a time.
+    */
+    XClipBox(rootVisible, &box);
+
+    if (box.width == 0 || box.height == 0)
+        return;
+
+    for (int rx = 0; rx < activeRoaches; rx++)
+        if ((roaches.flags[rx] & ROACH_HIDDEN) && RoachInPatch(rootVisible, &box, rx))
+            ShowRoach(rx);
+
+    uncoverPatch = rootVisible;
+    uncoverBox = box;
+
+    for (long bx = 0; bx < rootVisible->numRects; bx++)
+    {
+        visible = &rootVisible->rects[bx];
+        ShowRoachesIn(visible->x1, visible->y1, visible->x2 - visible->x1, visible->y2 - visible->y1,
+                      RoachUncovered);
+    }
+}
+
+void WindowCreated(Window id, int x, int y, int width, int height, int border)
+{
+    SetWindow(id, x, y, width, height, border, 0, WINDOW_UNKNOWN);
+}
+
+void WindowDestroyed(Window id)
+{
+    int        wasCovering;
+    WinRect    *w;
+    XRectangle old;
+
+    w = FindWindowRect(id);
+
+    if (w == NULL)
+        return;
+
+    old = w->rect;
+    wasCovering = Covers(w);
+    w->id = DELETED_WINDOW;
+
+    PatchVisible(NULL, &old, wasCovering);
+}
+
+void WindowConfigured(Window id, int x, int y, int width, int height, int border)
+{
+    int        wasCovering;
+    WinRect    *w;
+    XRectangle old;
+
+    w = InsertWindowRect(id);
+
+    if (w == NULL)
+        return;
+
+    old = w->rect;
+    wasCovering = Covers(w);
+
+    w->rect.x = (short) x;
+    w->rect.y = (short) y;
+    w->rect.width = (unsigned short) (width + (border * 2));
+    w->rect.height = (unsigned short) (height + (border * 2));
+
+    if (old.x == w->rect.x && old.y == w->rect.y &&
+        old.width == w->rect.width && old.height == w->rect.height)
+        return;
+
+    PatchVisible(w, &old, wasCovering);
+}
+
+void WindowMoved(Window id, int x, int y)
+{
+    WinRect *w;
+
+    w = FindWindowRect(id);
+
+    if (w != NULL)
+        WindowConfigured(id, x, y, w->rect.width, w->rect.height, 0);
+}
+
+void WindowMapped(Window id, int kind)
+{
+    int     wasCovering;
+    WinRect *w;
+
+    w = InsertWindowRect(id);
+
+    if (w == NULL)
+        return;
+
+    wasCovering = Covers(w);
+    w->mapped = 1;
+    w->kind = kind;
+
+    if (!wasCovering)
+        PatchVisible(w, &w->rect, 0);
+}
+
+void WindowUnmapped(Window id)
+{
+    int        wasCovering;
+    WinRect    *w;
+
+    w = FindWindowRect(id);
+
+    if (w == NULL)
+        return;
+
+    wasCovering = Covers(w);
+    w->mapped = 0;
+
+    PatchVisible(w, &w->rect, wasCovering);
+}
+
+/*
+   Is the part of the given rectangle that is on the screen all in the
+   visible region?  The root only gets exposed where nothing covers it, so
+   an Expose outside the region means the window cache has missed a
+   change.
+*/
+int RectVisible(int x, int y, int width, int height)
+{
+    if (rootVisible == NULL)
+        return 0;
+
+    if (x < 0)
+    {
+        width += x;
+        x = 0;
+    }
+
+    if (y < 0)
+    {
+        height += y;
+        y = 0;
+    }
+
+    if (x + width > (int) display_width)
+        width = (int) display_width - x;
+
+    if (y + height > (int) display_height)
+        height = (int) display_height - y;
+
+    if (width <= 0 || height <= 0)
+        return 1;
+
+    return XRectInRegion(rootVisible, x, y, (unsigned int) width, (unsigned int) height) == RectangleIn;
+}
+
+/*
+   Mark hidden roaches, using the cell bitmap rather than walking the
+   region for every roach.  Returns the number still visible.
+*/
+static int MarkHiddenChunk(int from, int to)
+{
+    int nVisible;
+
+    nVisible = 0;
+
+    for (int rx = from; rx < to; rx++)
+    {
+        if (!(roaches.flags[rx] & ROACH_HIDDEN))
+        {
+            if (roaches.intX[rx] > 0 &&
+                !CellsVisible(roaches.intX[rx],
+                              roaches.intY[rx],
+                              headingWidth[roaches.drawn[rx]],
+                              headingHeight[roaches.drawn[rx]]))
+                roaches.flags[rx] |= ROACH_HIDDEN;
+            else
+                nVisible++;
+        }
+    }
+
+    return nVisible;
+}
+
+/*
+   Tell the roaches where the cover is now, from the cell bitmap.
+*/
+static void UpdateCover()
+{
+    for (int cy = 0; cy < coverRows; cy++)
+        for (int cx = 0; cx < coverCols; cx++)
+            coverCells[cy * coverCols + cx] = !CellsVisible(cx << COVER_SHIFT, cy << COVER_SHIFT,
+                                                            1 << COVER_SHIFT, 1 << COVER_SHIFT);
+
+    BuildCoverField();
+    coverStale = 0;
+}
+
+int MarkHiddenRoaches()
+{
+    /* Window changes come in bursts; rebuild the field once they settle. */
+    if (coverStale && coverCells != NULL)
+        UpdateCover();
+
+    /* The bitmap is only read here, so the chunks can go in parallel. */
+    return ForEachChunk(MarkHiddenChunk);
+}
@@ -0,0 +1,38 @@
+/*
+    Visible region of the root window.
+
+    Keeps a rectangle for every child of the root, keyed by window ID, and
+    derives the region of the root not covered by any of them.  The cache
+    is filled by a full scan and then kept up to date from the
+    SubstructureNotify events on the root, patching only the part of the
+    region that an event affects.  Only client-side region code is used,
+    so none of this talks to the X server.
+*/
+
+#ifndef VISIBLE_H
+#define VISIBLE_H
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+/* Window kinds; only InputOutput windows hide roaches. */
+#define WINDOW_UNKNOWN      0
+#define WINDOW_INPUT_OUTPUT 1
+#define WINDOW_INPUT_ONLY   2
+
+extern Region rootVisible;
+
+void ClearWindows();
+void SetWindow(Window id, int x, int y, int width, int height, int border, int mapped, int kind);
+int WindowKind(Window id);
+void ResetVisible();
+void WindowCreated(Window id, int x, int y, int width, int height, int border);
+void WindowDestroyed(Window id);
+void WindowConfigured(Window id, int x, int y, int width, int height, int border);
+void WindowMoved(Window id, int x, int y);
+void WindowMapped(Window id, int kind);
+void WindowUnmapped(Window id);
+int RectVisible(int x, int y, int width, int height);
+int MarkHiddenRoaches();
+
+#endif /* VISIBLE_H */
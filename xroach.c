@@ -9,7 +9,7 @@
     copyright notices are retained.
 
     To build:
-      cc -I/usr/local/include/ -L/usr/local/lib/ -o xroach xroach.c -lm -lX11
+      cc -I/usr/local/include/ -L/usr/local/lib/ -o xroach xroach.c roach.c visible.c stats.c trace.c profile.c -lm -lpthread -lX11
 
     To run:
       ./xroach -speed 2 -squish -rc brown -rgc yellowgreen
@@ -35,14 +35,44 @@
 #include <X11/Xos.h>
 #include <X11/Xatom.h>
 
+#if HAVE_XRENDER
+#include <X11/extensions/Xrender.h>
+#endif
+
+#if HAVE_XCB
+#include <X11/Xproto.h>
+#include <xcb/xcb.h>
+#endif
+
+#if HAVE_XSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
+
+#if HAVE_TIMERFD
+#include <stdint.h>
+#include <sys/timerfd.h>
+#endif
+
+#if HAVE_SIGNALFD
+#include <sys/signalfd.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
-#include <math.h>
+#include <poll.h>
+#include <time.h>
 
 char Copyright[] = "Xroach\nCopyright 1991 J.T. Anderson";
 
-#include "roachmap.h"
+#include "roach.h"
+#include "visible.h"
+#include "stats.h"
+#include "trace.h"
+#include "profile.h"
+#include "squish.xbm"
 
 typedef unsigned long Pixel;
 typedef int ErrorHandler();
@@ -53,58 +83,138 @@ typedef int ErrorHandler();
 #define GRAB_SERVER    0
 #endif
 
+#define GLYPH_BATCH    1024    /* roaches per batched draw request */
+#define TILE_SIZE      64      /* size of a back buffer damage tile */
+#define BAND_HEIGHT    16      /* height of a software frame damage band */
+#define SQUISH_HITS    64      /* roaches squished per index lookup */
+#define TICK_USEC      20000   /* time between simulation ticks */
+#define MAX_TICKS      10      /* ticks caught up with in one frame */
+#define STATS_USEC     1000000 /* time between lines of -stats output */
+#define CHECK_FRAMES   250     /* frames between checksums in a -record trace */
+
 char         *display_name = NULL;
 Display      *display;
 GC           gc;
 GC           gutsGC;
 int          screen;
 Pixel        black;
-unsigned int display_height;
-unsigned int display_width;
 Window       rootWin;
 
 Bool   squishRoach = False;
+Bool   exactSquish = False;
 Bool   squishWinUp = False;
-int    done        = 0;
+volatile sig_atomic_t done = 0;
+volatile sig_atomic_t statsWanted = 0;
 int    errorVal    = 0;
-int    eventBlock  = 0;
-Pixmap squishMap;
+int    squishAtlasX;
+Bool   showStartup = False;
 
-typedef struct Roach
-{
-    RoachMap *rp;
-    int      index;
-    float    x;
-    float    y;
-    int      intX;
-    int      intY;
-    int      hidden;
-    int      turnLeft;
-    int      steps;
-} Roach;
-
-Roach *roaches;
-int   maxRoaches = 10;
-int   curRoaches = 0;
-float roachSpeed = 20.0;
-float turnSpeed  = 10.0;
-
-Region rootVisible = NULL;
+/*
+   Every roach heading and the squish sprite side by side in one bitmap,
+   used as the stipple of the drawing GCs.  A sprite is picked out of it
+   by the tile-stipple origin alone.
+*/
+Pixmap spriteAtlas = None;
+
+Bool   batchDraw   = False;
+Bool   doubleBuffer = False;
+
+#if HAVE_XRENDER
+GlyphSet roachGlyphs;
+Picture  roachFill;
+Picture  rootPicture;
+Picture  backPicture;
+#endif
+
+Bool            shmDraw = False;
+XImage          *frameImage;
+char            *frameBackground;
+Bool            frameShared = False;
+int             nBands;
+int             *bandMinX;
+int             *bandMaxX;
+Pixel           framePixel;
+Pixel           gutsPixel;
+Bool            frameNative;
+unsigned long   *spriteRows;
+
+#if HAVE_XSHM
+XShmSegmentInfo shmInfo;
+#endif
+
+Pixmap        backBuffer;
+Pixmap        rootBackground;
+GC            copyGC;
+unsigned char *dirtyTiles;
+int           tilesX;
+int           tilesY;
+
+/*
+   Frame clock and signals, waited on together with the X connection.
+   Without timerfd the clock is the poll timeout, and without signalfd
+   the signal handler just interrupts the poll.  The simulation ticks at
+   a fixed rate of its own; tickTime is how far it is behind the clock.
+*/
+int    frameFd   = -1;
+int    signalFd  = -1;
+int    frameRunning = 0;
+int    frameRate = 1000000 / TICK_USEC;
+double frameUsec = TICK_USEC;
+double nextFrame = 0;
+double lastFrame = 0;
+double tickTime  = 0;
+
+FILE   *statsFile = NULL;
+double nextStats  = 0;
+
+#if HAVE_XCB
+/*
+   Second connection to the server, used for pipelined window tree scans.
+*/
+xcb_connection_t                   *xconn = NULL;
+xcb_get_window_attributes_cookie_t *attributeCookies = NULL;
+xcb_get_geometry_cookie_t          *geometryCookies = NULL;
+int                                maxScanCookies = 0;
+#endif
 
 void Usage();
 void SigHandler();
+void StatsHandler();
+void CheckStats();
+void InitMainLoop();
+double NowUsec();
+void RunFrameClock(int run);
+int WaitForEvents();
+int StepRoaches();
 Window FindRootWindow();
-int RandInt(int maxVal);
-int RoachInRect(Roach *roach, int rx, int ry, int x, int y, unsigned int width, unsigned int height);
-int RoachOverRect(Roach *roach, int rx, int ry, int x, int y, unsigned int width, unsigned int height);
-void AddRoach();
-void TurnRoach(Roach *roach);
-void MoveRoach(int rx);
+Bool InitBatchDraw(Pixel roachPixel);
+void PackSprite(char *atlas, int rowBytes, int atlasX, char *spriteBits, int width, int height);
+void InitSpriteAtlas();
+void StippleRoach(Drawable d, int rx);
 void DrawRoaches();
+#if HAVE_XRENDER
+void CompositeRoaches(Picture target);
+#endif
+void DrawRoachesBatched();
+void InitDoubleBuffer();
+void DamageTiles(int x, int y, int width, int height);
+void CopyDirtyTiles(Drawable from, Drawable to);
+void DrawRoachesBuffered();
+void RefreshBackground(XExposeEvent *expose);
+Bool InitShmDraw(Pixel roachPixel);
+void DamageBands(int x, int y, int width, int height);
+void BlitRoach(int rx);
+void EraseRoach(int rx);
+void SquishFrame(int rx);
+void DrawRoachesShm();
 void CoverRoot();
 int RoachErrors(Display *display, XErrorEvent *err);
+void ScanWindows();
+#if HAVE_XCB
+void ScanWindowsXcb();
+#endif
 int CalcRootVisible();
-int MarkHiddenRoaches();
+int FetchWindowKind(Window id);
 Pixel AllocNamedColor(char *colorName, Pixel dfltPix);
 void checkSquish(XButtonEvent *buttonEvent);
 
@@ -113,14 +223,28 @@ int main(int ac, char *av[])
     char                 *arg;
     char                 *gutsColor  = NULL;
     char                 *roachColor = "black";
-    float                angle;
     int                  needCalc;
+    int                  seeded = 0;
+    uint64_t             seed = 0;
     int                  nVis;
-    RoachMap             *rp;
     Window               squishWin;
     XEvent               ev;
     XGCValues            xgcv;
     XSetWindowAttributes xswa;
+    double               startTime;
+    double               frameStart;
+    double               frameEnd;
+    double               renderStart;
+    unsigned long        startRequest;
+    unsigned long        frameRequest;
+    int                  ticks;
+    long                 frames = 0;
+    char                 *recordFile = NULL;
+    char                 *replayFile = NULL;
+    char                 *profileFile = NULL;
+    double               spawnRate = 0;
+
+    startTime = NowUsec();
 
     /*
        Process command line options.
@@ -137,29 +261,76 @@ int main(int ac, char *av[])
             roachSpeed = (float) strtod(av[++ax], (char **) NULL);
         else if (strcmp(arg, "-roaches") == 0)
             maxRoaches = (int) strtol(av[++ax], (char **) NULL, 0);
+        else if (strcmp(arg, "-spawn") == 0)
+            spawnRate = strtod(av[++ax], (char **) NULL);
         else if (strcmp(arg, "-squish") == 0)
             squishRoach = True;
+        else if (strcmp(arg, "-exact") == 0)
+            exactSquish = True;
         else if (strcmp(arg, "-rgc") == 0)
             gutsColor = av[++ax];
+        else if (strcmp(arg, "-batch") == 0)
+            batchDraw = True;
+        else if (strcmp(arg, "-double") == 0)
+            doubleBuffer = True;
+        else if (strcmp(arg, "-shm") == 0)
+            shmDraw = True;
+        else if (strcmp(arg, "-collide") == 0)
+            collisionMode = COLLIDE_GRID;
+        else if (strcmp(arg, "-wander") == 0)
+            coverSeeking = 0;
+        else if (strcmp(arg, "-fps") == 0)
+            frameRate = (int) strtol(av[++ax], (char **) NULL, 0);
+        else if (strcmp(arg, "-threads") == 0)
+            roachThreads = (int) strtol(av[++ax], (char **) NULL, 0);
+        else if (strcmp(arg, "-startup") == 0)
+            showStartup = True;
+        else if (strcmp(arg, "-stats") == 0)
+        {
+            statsFile = fopen(av[++ax], "a");
+
+            if (statsFile == NULL)
+            {
+                perror(av[ax]);
+                exit(1);
+            }
+        }
+        else if (strcmp(arg, "-record") == 0)
+            recordFile = av[++ax];
+        else if (strcmp(arg, "-replay") == 0)
+            replayFile = av[++ax];
+        else if (strcmp(arg, "-profile") == 0)
+            profileFile = av[++ax];
+        else if (strcmp(arg, "-seed") == 0)
+        {
+            seed = (uint64_t) strtoull(av[++ax], (char **) NULL, 0);
+            seeded = 1;
+        }
         else
             Usage();
     }
 
-    /* Compensate rate of turning for speed of movement. */
-    turnSpeed = 200 / roachSpeed;
+    if (frameRate < 1 || roachThreads < 1 || spawnRate < 0 || maxRoaches < 0)
+        Usage();
+
+    frameUsec = 1e6 / frameRate;
+    roachSpawn = (float) (spawnRate * TICK_USEC / 1e6);
+
+    /*
+       A replay needs no X server; it only runs the simulation.
+    */
+    if (replayFile != NULL)
+        return ReplayTrace(replayFile);
 
-    if (turnSpeed < 1)
-        turnSpeed = 1;
+    if (!seeded)
+        seed = (uint64_t) time((time_t *) NULL);
 
-    srand((unsigned int) time((time_t *) NULL));
+    SeedRoaches(seed);
 
     /*
        Catch some signals so we can erase any visible roaches.
     */
-    signal(SIGKILL, SigHandler);
-    signal(SIGINT, SigHandler);
-    signal(SIGTERM, SigHandler);
-    signal(SIGHUP, SigHandler);
+    InitMainLoop();
 
     display = XOpenDisplay(display_name);
 
@@ -182,52 +353,85 @@ int main(int ac, char *av[])
     display_width  = (unsigned int) DisplayWidth(display, screen);
     display_height = (unsigned int) DisplayHeight(display, screen);
 
+#if HAVE_XCB
     /*
-       Create roach pixmaps at several orientations.
+       Window tree scans go over their own connection, so they can be
+       pipelined.  Fall back to Xlib if it cannot be opened.
     */
-    for (int ax = 0; ax < 360; ax += ROACH_ANGLE)
+    xconn = xcb_connect(display_name, NULL);
+
+    if (xcb_connection_has_error(xconn))
     {
-        int rx = ax / ROACH_ANGLE;
-        angle = (float) (rx * 0.261799387799);
-        rp = &roachPix[rx];
-        rp->pixmap = XCreateBitmapFromData(display,
-                                           rootWin,
-                                           rp->roachBits,
-                                           (unsigned int) rp->width,
-                                           (unsigned int) rp->height);
-        rp->sine = (float) sin(angle);
-        rp->cosine = (float) cos(angle);
+        xcb_disconnect(xconn);
+        xconn = NULL;
     }
+#endif
 
-    /*
-      Create the squished pixmap
-    */
-    if (squishRoach)
-        squishMap = XCreateBitmapFromData(display,
-                                          rootWin,
-                                          squish_bits,
-                                          squish_width,
-                                          squish_height);
+    if (recordFile != NULL && !StartRecording(recordFile, seed, exactSquish))
+    {
+        perror(recordFile);
+        exit(1);
+    }
 
-    roaches = (Roach *) malloc(sizeof(Roach) * maxRoaches);
+    if (profileFile != NULL && !StartProfile(display, profileFile))
+    {
+        perror(profileFile);
+        exit(1);
+    }
+
+    startRequest = NextRequest(display);
+
+    if (!InitRoaches())
+    {
+        fprintf(stderr, "%s: cannot allocate %d roaches\n", av[0], maxRoaches);
+        exit(1);
+    }
 
     gc = XCreateGC(display, rootWin, 0L, &xgcv);
     XSetForeground(display, gc, AllocNamedColor(roachColor, black));
     XSetFillStyle(display, gc, FillStippled);
 
+    if (batchDraw && !InitBatchDraw(AllocNamedColor(roachColor, black)))
+    {
+        fprintf(stderr, "%s: batched drawing needs the RENDER extension\n", av[0]);
+        batchDraw = False;
+    }
+
+    if (shmDraw && !InitShmDraw(AllocNamedColor(roachColor, black)))
+    {
+        fprintf(stderr, "%s: cannot set up software rendering\n", av[0]);
+        shmDraw = False;
+    }
+
+    if (doubleBuffer && !shmDraw)
+        InitDoubleBuffer();
+    else
+        doubleBuffer = False;
+
     if (squishRoach && gutsColor != NULL)
     {
+        gutsPixel = AllocNamedColor(gutsColor, black);
         gutsGC = XCreateGC(display, rootWin, 0L, &xgcv);
-        XSetForeground(display, gutsGC, AllocNamedColor(gutsColor, black));
+        XSetForeground(display, gutsGC, gutsPixel);
         XSetFillStyle(display, gutsGC, FillStippled);
     }
     else
     {
+        gutsPixel = framePixel;
         gutsGC = gc;
     }
 
-    while (curRoaches < maxRoaches)
-        AddRoach();
+    /*
+       Only the stippled drawing needs the sprites on the server.
+    */
+    if (squishRoach || (!shmDraw && !batchDraw))
+        InitSpriteAtlas();
+
+    if (!AddRoaches(roachSpawn > 0 ? SPAWN_START : maxRoaches))
+    {
+        fprintf(stderr, "%s: cannot allocate %d roaches\n", av[0], maxRoaches);
+        exit(1);
+    }
 
     XSelectInput(display, rootWin, ExposureMask | SubstructureNotifyMask);
 
@@ -246,7 +450,18 @@ int main(int ac, char *av[])
         XLowerWindow(display, squishWin);
     }
 
+    if (showStartup)
+    {
+        XSync(display, False);
+        fprintf(stderr, "%s: started in %.2f ms, %lu requests\n",
+                av[0],
+                (NowUsec() - startTime) / 1e3,
+                NextRequest(display) - startRequest);
+    }
+
     needCalc = 1;
+    StartStats(NowUsec());
+    nextStats = NowUsec() + STATS_USEC;
 
     while (!done)
     {
@@ -262,9 +477,11 @@ int main(int ac, char *av[])
             if (needCalc)
                 nVis = 0;
             else
-                nVis = MarkHiddenRoaches();
+                nVis = TraceMarkHidden();
 
-            ev.type = SCAMPER_EVENT;
+            stats.visible = nVis;
+            stats.hidden = curRoaches - nVis;
+            CheckStats();
 
             if (nVis)
             {
@@ -281,40 +498,104 @@ int main(int ac, char *av[])
                     XUnmapWindow(display, squishWin);
                     squishWinUp = False;
                 }
+            }
 
-                /*
-                if (needCalc == 0)
-                    DrawRoaches();
+            /*
+               Only keep the frame clock going while there is something to
+               animate, or roaches that have been uncovered still have to
+               wake up.  With every roach hidden and asleep nothing can
+               change until the server tells us about it, so sleep until
+               then.
+            */
+            RunFrameClock(nVis || needCalc || WakingRoaches());
 
-                eventBlock = 1;
-                XNextEvent(display, &ev);
-                eventBlock = 0;
-                */
-            }
+            if (!WaitForEvents())
+                continue;
+
+            ev.type = SCAMPER_EVENT;
         }
 
         switch (ev.type)
         {
             case SCAMPER_EVENT:
-                for (int rx = 0; rx < curRoaches; rx++)
-                    if (!roaches[rx].hidden)
-                        MoveRoach(rx);
-
+                frameStart = NowUsec();
+                frameRequest = NextRequest(display);
+                ticks = StepRoaches();
+                renderStart = NowUsec();
+                ProfilePart(PROFILE_DRAW);
                 DrawRoaches();
+                HideRoaches();
+                ProfilePart(PROFILE_SYNC);
                 XFlush(display);
-                usleep(20000);
-                XSync(display, False);
+                ProfilePart(PROFILE_OTHER);
+                TraceFrame(ticks);
+
+                if (++frames % CHECK_FRAMES == 0)
+                    TraceCheckpoint();
+
+                frameEnd = NowUsec();
+                stats.renderUsec += frameEnd - renderStart;
+                CountFrame(frameEnd - frameStart, NextRequest(display) - frameRequest);
+                ProfileFrame(frames, frameEnd - frameStart);
+                break;
+
+            /*
+               Window changes patch the window cache and the visible
+               region directly.
+            */
+            case CreateNotify:
+                TraceEvent(TRACE_CREATE, ev.xcreatewindow.window,
+                           ev.xcreatewindow.x, ev.xcreatewindow.y,
+                           ev.xcreatewindow.width, ev.xcreatewindow.height,
+                           ev.xcreatewindow.border_width, 0, 0);
+                break;
+
+            case DestroyNotify:
+                TraceEvent(TRACE_DESTROY, ev.xdestroywindow.window, 0, 0, 0, 0, 0, 0, 0);
+                break;
+
+            case ConfigureNotify:
+                TraceEvent(TRACE_CONFIGURE, ev.xconfigure.window,
+                           ev.xconfigure.x, ev.xconfigure.y,
+                           ev.xconfigure.width, ev.xconfigure.height,
+                           ev.xconfigure.border_width, 0, 0);
+                break;
+
+            case GravityNotify:
+                TraceEvent(TRACE_MOVE, ev.xgravity.window, ev.xgravity.x, ev.xgravity.y, 0, 0, 0, 0, 0);
+                break;
+
+            case MapNotify:
+                if (ev.xmap.window != squishWin)
+                    TraceEvent(TRACE_MAP, ev.xmap.window, 0, 0, 0, 0, 0, 0, FetchWindowKind(ev.xmap.window));
                 break;
 
             case UnmapNotify:
                 if (ev.xunmap.window != squishWin)
+                    TraceEvent(TRACE_UNMAP, ev.xunmap.window, 0, 0, 0, 0, 0, 0, 0);
+                break;
+
+            case ReparentNotify:
+                if (ev.xreparent.parent == rootWin)
                     needCalc = 1;
+                else
+                    TraceEvent(TRACE_DESTROY, ev.xreparent.window, 0, 0, 0, 0, 0, 0, 0);
                 break;
 
-            case MapNotify:
+            /*
+               The roaches redraw themselves every frame, so an exposed
+               root needs nothing from us but the new background.  It only
+               calls for a full scan if the window cache thinks the area
+               is covered.
+            */
             case Expose:
-            case ConfigureNotify:
-                needCalc = 1;
+                stats.exposes++;
+
+                if (doubleBuffer || shmDraw)
+                    RefreshBackground(&ev.xexpose);
+
+                if (!RectVisible(ev.xexpose.x, ev.xexpose.y, ev.xexpose.width, ev.xexpose.height))
+                    needCalc = 1;
                 break;
 
             case ButtonPress:
@@ -327,9 +608,22 @@ int main(int ac, char *av[])
         }
     }
 
+    /* The last checkpoint needs the roaches still around. */
+    TraceCheckpoint();
+    StopRecording();
+
     CoverRoot();
+#if HAVE_XCB
+    if (xconn != NULL)
+        xcb_disconnect(xconn);
+#endif
     XCloseDisplay(display);
-    free(roaches);
+    StopProfile(stderr);
+    FreeRoaches();
+
+    if (statsFile != NULL)
+        fclose(statsFile);
+
     return 0;
 }
 
@@ -342,29 +636,256 @@ void Usage()
     USEPRT("       -display displayname\n");
     USEPRT("       -rc      roachcolor\n");
     USEPRT("       -roaches numroaches\n");
+    USEPRT("       -spawn   spawnrate\n");
     USEPRT("       -speed   roachspeed\n");
     USEPRT("       -squish\n");
+    USEPRT("       -exact\n");
     USEPRT("       -rgc     roachgutscolor\n");
+    USEPRT("       -batch\n");
+    USEPRT("       -double\n");
+    USEPRT("       -shm\n");
+    USEPRT("       -collide\n");
+    USEPRT("       -wander\n");
+    USEPRT("       -fps     framerate\n");
+    USEPRT("       -threads numthreads\n");
+    USEPRT("       -seed    seed\n");
+    USEPRT("       -startup\n");
+    USEPRT("       -stats   statsfile\n");
+    USEPRT("       -record  tracefile\n");
+    USEPRT("       -replay  tracefile\n");
+    USEPRT("       -profile csvfile\n");
 
     exit(1);
 }
 
 void SigHandler()
 {
+    done = 1;
+}
+
+void StatsHandler()
+{
+    statsWanted = 1;
+}
+
+/*
+   Write a line of stats if one was asked for with SIGUSR1, to the -stats
+   file or else to stderr, or if the -stats file is due for one.
+*/
+void CheckStats()
+{
+    double now;
+
+    now = NowUsec();
+
+    if (statsWanted || (statsFile != NULL && now >= nextStats))
+    {
+        WriteStats(statsFile != NULL ? statsFile : stderr, now);
+        nextStats = now + STATS_USEC;
+        statsWanted = 0;
+    }
+}
+
+/*
+   Set up the frame clock and route the signals we clean up after into the
+   main loop, so that the roaches are always erased from there.
+*/
+void InitMainLoop()
+{
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+
+#if HAVE_SIGNALFD
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+#endif
+
+    if (signalFd < 0)
+    {
+        sigprocmask(SIG_UNBLOCK, &signals, NULL);
+        signal(SIGINT, SigHandler);
+        signal(SIGTERM, SigHandler);
+        signal(SIGHUP, SigHandler);
+        signal(SIGUSR1, StatsHandler);
+    }
+
+#if HAVE_TIMERFD
+    frameFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+}
+
+/*
+   Monotonic time in microseconds.
+*/
+double NowUsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+   Start or stop the frame clock.  A stopped clock never wakes us up.
+*/
+void RunFrameClock(int run)
+{
+#if HAVE_TIMERFD
+    struct itimerspec its;
+#endif
+
+    if (run == frameRunning)
+        return;
+
+    frameRunning = run;
+    lastFrame = NowUsec();
+    nextFrame = lastFrame + frameUsec;
+
+#if HAVE_TIMERFD
+    if (frameFd >= 0)
+    {
+        its.it_interval.tv_sec = run ? (time_t) (frameUsec / 1e6) : 0;
+        its.it_interval.tv_nsec = run ? (long) ((frameUsec - its.it_interval.tv_sec * 1e6) * 1e3) : 0;
+        its.it_value = its.it_interval;
+        timerfd_settime(frameFd, 0, &its, NULL);
+    }
+#endif
+}
+
+/*
+   Flush our requests and sleep until the server sends something, a signal
+   arrives or the next frame is due, unless events are already waiting in
+   the Xlib queue.  Returns True for a frame.  Frames
+   missed while busy are dropped rather than caught up with.
+*/
+int WaitForEvents()
+{
+    struct pollfd fds[3];
+    int           nFds;
+    int           timeout;
+    double        now;
+#if HAVE_TIMERFD
+    uint64_t      ticks;
+#endif
+#if HAVE_SIGNALFD
+    struct signalfd_siginfo info;
+#endif
+
+    ProfilePart(PROFILE_SYNC);
+    XFlush(display);
+    ProfilePart(PROFILE_OTHER);
+
     /*
-       If we are blocked, no roaches are visible and we can just bail
-       out.  If we are not blocked, then let the main procedure clean
-       up the root window.
+       A round trip since the last look may have read events into the
+       Xlib queue, and poll would not see them until the server sends more.
     */
-    if (eventBlock)
+    if (XEventsQueued(display, QueuedAlready) > 0)
+        return False;
+
+    fds[0].fd = ConnectionNumber(display);
+    fds[0].events = POLLIN;
+    fds[1].fd = signalFd;
+    fds[1].events = POLLIN;
+    fds[2].fd = frameFd;
+    fds[2].events = POLLIN;
+    nFds = frameFd >= 0 ? 3 : 2;
+    timeout = -1;
+
+    if (frameRunning && frameFd < 0)
     {
-        XCloseDisplay(display);
-        exit(0);
+        now = NowUsec();
+
+        if (now >= nextFrame)
+        {
+            nextFrame = now + frameUsec;
+            return True;
+        }
+
+        timeout = (int) ((nextFrame - now) / 1000) + 1;
     }
-    else
+
+    /* Wake up in time for the next line of -stats output, too. */
+    if (statsFile != NULL)
+    {
+        now = NowUsec();
+
+        if (now >= nextStats)
+            return False;
+
+        if (timeout < 0 || timeout > (int) ((nextStats - now) / 1000) + 1)
+            timeout = (int) ((nextStats - now) / 1000) + 1;
+    }
+
+    if (poll(fds, (nfds_t) nFds, timeout) < 0)
+        return False;
+
+#if HAVE_SIGNALFD
+    if (fds[1].revents & POLLIN)
+    {
+        if (read(signalFd, &info, sizeof(info)) == sizeof(info))
+        {
+            if (info.ssi_signo == SIGUSR1)
+                statsWanted = 1;
+            else
+                done = 1;
+        }
+
+        return False;
+    }
+#endif
+
+#if HAVE_TIMERFD
+    if (frameFd >= 0)
+        return (fds[2].revents & POLLIN) && read(frameFd, &ticks, sizeof(ticks)) == sizeof(ticks);
+#endif
+
+    now = NowUsec();
+
+    if (frameRunning && now >= nextFrame)
+    {
+        nextFrame = now + frameUsec;
+        return True;
+    }
+
+    return False;
+}
+
+/*
+   Run as many simulation ticks as the time since the last frame is worth,
+   so roaches keep their speed whatever the frame rate, and leave the
+   remainder in roachLerp so they are drawn in between ticks.  After a long
+   stall only MAX_TICKS are caught up with; the rest is dropped.  Returns
+   the number of ticks run.
+*/
+int StepRoaches()
+{
+    double now;
+    int    ticks;
+
+    now = NowUsec();
+    tickTime += now - lastFrame;
+    lastFrame = now;
+
+    if (tickTime > MAX_TICKS * TICK_USEC)
+        tickTime = MAX_TICKS * TICK_USEC;
+
+    for (ticks = 0; tickTime >= TICK_USEC; ticks++)
     {
-        done = 1;
+        MoveRoaches();
+        tickTime -= TICK_USEC;
     }
+
+    stats.ticks += ticks;
+    stats.simUsec += NowUsec() - now;
+    roachLerp = (float) (tickTime / TICK_USEC);
+
+    return ticks;
 }
 
 /*
@@ -445,193 +966,907 @@ Window FindRootWindow()
 }
 
 /*
-   Generate random integer between 0 and maxVal-1.
+   Set up batched drawing.  Every orientation is uploaded once as a glyph,
+   so a whole frame of roaches can be drawn with a handful of
+   CompositeGlyphs requests and no GC changes at all.  Returns False if
+   the server cannot do it.
 */
-int RandInt(int maxVal)
+Bool InitBatchDraw(Pixel roachPixel)
 {
-    return rand() % maxVal;
-}
+#if HAVE_XRENDER
+    char              *bits;
+    int               eventBase;
+    int               errorBase;
+    int               stride;
+    unsigned char     byte;
+    unsigned char     reversed;
+    Glyph             gid;
+    RoachMap          *rp;
+    XColor            color;
+    XGlyphInfo        info;
+    XRenderColor      fill;
+    XRenderPictFormat *format;
+
+    if (!XRenderQueryExtension(display, &eventBase, &errorBase))
+        return False;
+
+    format = XRenderFindVisualFormat(display, DefaultVisual(display, screen));
+
+    if (format == NULL)
+        return False;
+
+    roachGlyphs = XRenderCreateGlyphSet(display,
+                                        XRenderFindStandardFormat(display, PictStandardA1));
 
-/*
-   Check for roach completely in specified rectangle.
-*/
-int RoachInRect(Roach *roach, int rx, int ry, int x, int y, unsigned int width, unsigned int height)
-{
-    if (rx < x)
-        return 0;
+    /*
+       A1 glyph rows are padded to 32 bits and use the server's bit order;
+       the XBM data is padded to 8 bits and always LSB first.
+    */
+    for (int hx = 0; hx < ROACH_HEADINGS; hx++)
+    {
+        rp = &roachPix[hx];
+        stride = ((rp->width + 31) / 32) * 4;
+        bits = (char *) calloc((size_t) (stride * rp->height), 1);
 
-    if ((rx + roach->rp->width) > (x + width))
-        return 0;
+        for (int y = 0; y < rp->height; y++)
+        {
+            for (int x = 0; x < (rp->width + 7) / 8; x++)
+            {
+                byte = (unsigned char) rp->roachBits[y * ((rp->width + 7) / 8) + x];
 
-    if (ry < y)
-        return 0;
+                if (BitmapBitOrder(display) == MSBFirst)
+                {
+                    reversed = 0;
 
-    if ((ry + roach->rp->height) > (y + height))
-        return 0;
+                    for (int bx = 0; bx < 8; bx++)
+                        if (byte & (1 << bx))
+                            reversed |= (unsigned char) (0x80 >> bx);
 
-    return 1;
-}
+                    byte = reversed;
+                }
 
-/*
-   Check for roach overlapping specified rectangle.
-*/
-int RoachOverRect(Roach *roach, int rx, int ry, int x, int y, unsigned int width, unsigned int height)
-{
-    if (rx >= (x + width))
-        return 0;
+                bits[y * stride + x] = (char) byte;
+            }
+        }
 
-    if ((rx + roach->rp->width) <= x)
-        return 0;
+        info.width = (unsigned short) rp->width;
+        info.height = (unsigned short) rp->height;
+        info.x = 0;
+        info.y = 0;
+        info.xOff = 0;
+        info.yOff = 0;
+        gid = (Glyph) hx;
 
-    if (ry >= (y + height))
-        return 0;
+        XRenderAddGlyphs(display, roachGlyphs, &gid, &info, 1, bits, stride * rp->height);
+        free(bits);
+    }
+
+    color.pixel = roachPixel;
+    XQueryColor(display, DefaultColormap(display, screen), &color);
 
-    if ((ry + roach->rp->height) <= y)
-        return 0;
+    fill.red = color.red;
+    fill.green = color.green;
+    fill.blue = color.blue;
+    fill.alpha = 0xffff;
 
-    return 1;
+    roachFill = XRenderCreateSolidFill(display, &fill);
+    rootPicture = XRenderCreatePicture(display, rootWin, format, 0, NULL);
+
+    return True;
+#else
+    return False;
+#endif
 }
 
 /*
-   Give birth to a roach.
+   Copy an XBM sprite into the atlas bits at column atlasX.
 */
-void AddRoach()
+void PackSprite(char *atlas, int rowBytes, int atlasX, char *spriteBits, int width, int height)
 {
-    Roach *r;
-
-    if (curRoaches < maxRoaches)
-    {
-        r = &roaches[curRoaches++];
-        r->index = RandInt(ROACH_HEADINGS);
-        r->rp = &roachPix[r->index];
-        r->x = RandInt(display_width - r->rp->width);
-        r->y = RandInt(display_height - r->rp->height);
-        r->intX = -1;
-        r->intY = -1;
-        r->hidden = 0;
-        r->steps = RandInt((int) turnSpeed);
-        r->turnLeft = RandInt(100) >= 50;
-    }
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            if (spriteBits[y * ((width + 7) / 8) + x / 8] & (1 << (x & 7)))
+                atlas[y * rowBytes + (atlasX + x) / 8] |= (char) (1 << ((atlasX + x) & 7));
 }
 
 /*
-   Turn a roach.
+   Pack all sprites into one bitmap and upload it with a single image
+   request, instead of a pixmap, GC and image per sprite.  The XBM data is
+   already in the LSB first, byte padded layout the image is declared
+   with, so sprites are copied over a bit at a time only to shift them to
+   their spot in the atlas.
 */
-void TurnRoach(Roach *roach)
+void InitSpriteAtlas()
 {
-    if (roach->index != (roach->rp - roachPix))
-        return;
+    GC       atlasGC;
+    XImage   *image;
+    char     *bits;
+    RoachMap *rp;
+    int      rowBytes;
+    int      width;
+    int      height;
 
-    if (roach->turnLeft)
-    {
-        roach->index += (RandInt(30) / 10) + 1;
+    width = 0;
+    height = squishRoach ? squish_height : 0;
 
-        if (roach->index >= ROACH_HEADINGS)
-            roach->index -= ROACH_HEADINGS;
-    }
-    else
+    for (int hx = 0; hx < ROACH_HEADINGS; hx++)
     {
-        roach->index -= (RandInt(30) / 10) + 1;
+        rp = &roachPix[hx];
+        rp->atlasX = width;
+        width += rp->width;
 
-        if (roach->index < 0)
-            roach->index += ROACH_HEADINGS;
+        if (rp->height > height)
+            height = rp->height;
     }
-}
 
-/*
-   Move a roach.
-*/
-void MoveRoach(int rx)
-{
-    float newX;
-    float newY;
-    Roach *roach;
+    squishAtlasX = width;
+
+    if (squishRoach)
+        width += squish_width;
 
-    roach = &roaches[rx];
-    newX = roach->x + (roachSpeed * roach->rp->cosine);
-    newY = roach->y - (roachSpeed * roach->rp->sine);
+    rowBytes = (width + 7) / 8;
+    bits = (char *) calloc((size_t) (rowBytes * height), 1);
 
-    if (RoachInRect(roach,
-                    (int) newX, (int) newY,
-                    0, 0,
-                    display_width, display_height))
+    if (bits == NULL)
     {
-        roach->x = newX;
-        roach->y = newY;
+        fprintf(stderr, "xroach: cannot allocate the sprite atlas\n");
+        exit(1);
+    }
 
-        if (roach->steps-- <= 0)
-        {
-            TurnRoach(roach);
-            roach->steps = RandInt((int) turnSpeed);
+    for (int hx = 0; hx < ROACH_HEADINGS; hx++)
+        PackSprite(bits, rowBytes, roachPix[hx].atlasX,
+                   roachPix[hx].roachBits, roachPix[hx].width, roachPix[hx].height);
 
-            /*
-               Previously, roaches would just go around in circles.
-               This makes their movement more interesting (and disgusting too!).
-            */
-            if (RandInt(100) >= 80)
-                roach->turnLeft ^= 1;
-        }
+    if (squishRoach)
+        PackSprite(bits, rowBytes, squishAtlasX, squish_bits, squish_width, squish_height);
 
-        /* This is a kind of anti-collision algorithm which doesn't do what it is supposed to do,
-           it eats CPU time and sometimes makes roaches spin around very crazy. Therefore it is
-           commented out.
+    image = XCreateImage(display, DefaultVisual(display, screen), 1, XYBitmap, 0, bits,
+                         (unsigned int) width, (unsigned int) height, 8, rowBytes);
+    image->byte_order = LSBFirst;
+    image->bitmap_bit_order = LSBFirst;
 
-        for (int ii = rx + 2; ii < curRoaches; ii++) {
-            r2 = &roaches[ii];
+    spriteAtlas = XCreatePixmap(display, rootWin, (unsigned int) width, (unsigned int) height, 1);
+    atlasGC = XCreateGC(display, spriteAtlas, 0L, NULL);
+    XPutImage(display, spriteAtlas, atlasGC, image, 0, 0, 0, 0, (unsigned int) width, (unsigned int) height);
+    XFreeGC(display, atlasGC);
+    XDestroyImage(image);
 
-            if (RoachOverRect(roach,
-                              (int) newX, (int) newY,
-                              r2->intX, r2->intY,
-                              (unsigned int) r2->rp->width, (unsigned int) r2->rp->height))
-                TurnRoach(roach);
+    XSetStipple(display, gc, spriteAtlas);
 
-        } */
-    }
-    else
-    {
-        TurnRoach(roach);
-    }
+    if (gutsGC != gc)
+        XSetStipple(display, gutsGC, spriteAtlas);
 }
 
 /*
-   Draw all roaches.
+   Draw one roach at its settled position with the stippled GC.
 */
-void DrawRoaches()
+void StippleRoach(Drawable d, int rx)
 {
-    Roach *roach;
+    RoachMap *rp;
 
-    for (int rx = 0; rx < curRoaches; rx++)
-    {
-        roach = &roaches[rx];
+    rp = &roachPix[roaches.drawn[rx]];
+    XSetTSOrigin(display, gc, roaches.intX[rx] - rp->atlasX, roaches.intY[rx]);
+    XFillRectangle(display,
+                   d,
+                   gc,
+                   roaches.intX[rx],
+                   roaches.intY[rx],
+                   (unsigned int) rp->width,
+                   (unsigned int) rp->height);
+}
 
-        if (!roach->hidden)
-        {
+/*
+   Draw all roaches.
+*/
+void DrawRoaches()
+{
+    RoachMap *rp;
+
+    if (shmDraw)
+    {
+        DrawRoachesShm();
+        return;
+    }
+
+    if (doubleBuffer)
+    {
+        DrawRoachesBuffered();
+        return;
+    }
+
+    if (batchDraw)
+    {
+        DrawRoachesBatched();
+        return;
+    }
+
+    for (int rx = 0; rx < activeRoaches; rx++)
+    {
+        if (!(roaches.flags[rx] & ROACH_HIDDEN))
+        {
+            rp = &roachPix[roaches.drawn[rx]];
             XClearArea(display,
                        rootWin,
-                       roach->intX,
-                       roach->intY,
-                       (unsigned int) roach->rp->width,
-                       (unsigned int) roach->rp->height,
+                       roaches.intX[rx],
+                       roaches.intY[rx],
+                       (unsigned int) rp->width,
+                       (unsigned int) rp->height,
                        False);
 
-            roach->intX = (int) roach->x;
-            roach->intY = (int) roach->y;
-            roach->rp = &roachPix[roach->index];
-
-            XSetStipple(display, gc, roach->rp->pixmap);
-            XSetTSOrigin(display, gc, roach->intX, roach->intY);
-            XFillRectangle(display,
-                           rootWin,
-                           gc,
-                           roach->intX,
-                           roach->intY,
-                           (unsigned int) roach->rp->width,
-                           (unsigned int) roach->rp->height);
+            SettleRoach(rx);
+            StippleRoach(rootWin, rx);
         }
         else
         {
-            roach->intX = -1;
+            roaches.intX[rx] = -1;
+        }
+    }
+}
+
+/*
+   Draw all visible, settled roaches onto target as glyphs, GLYPH_BATCH
+   to a request.
+*/
+#if HAVE_XRENDER
+void CompositeRoaches(Picture target)
+{
+    static unsigned int glyphs[GLYPH_BATCH];
+    static XGlyphElt32  elts[GLYPH_BATCH];
+    int                 nGlyphs;
+    int                 penX;
+    int                 penY;
+
+    nGlyphs = 0;
+    penX = 0;
+    penY = 0;
+
+    for (int rx = 0; rx < activeRoaches; rx++)
+    {
+        if (roaches.flags[rx] & ROACH_HIDDEN)
+            continue;
+
+        /* Glyph positions are relative to the previous one. */
+        glyphs[nGlyphs] = (unsigned int) roaches.drawn[rx];
+        elts[nGlyphs].glyphset = roachGlyphs;
+        elts[nGlyphs].chars = &glyphs[nGlyphs];
+        elts[nGlyphs].nchars = 1;
+        elts[nGlyphs].xOff = roaches.intX[rx] - penX;
+        elts[nGlyphs].yOff = roaches.intY[rx] - penY;
+        penX = roaches.intX[rx];
+        penY = roaches.intY[rx];
+
+        if (++nGlyphs == GLYPH_BATCH)
+        {
+            XRenderCompositeText32(display, PictOpOver, roachFill, target, NULL,
+                                   0, 0, 0, 0, elts, nGlyphs);
+            nGlyphs = 0;
+            penX = 0;
+            penY = 0;
+        }
+    }
+
+    if (nGlyphs > 0)
+        XRenderCompositeText32(display, PictOpOver, roachFill, target, NULL,
+                               0, 0, 0, 0, elts, nGlyphs);
+}
+#endif
+
+/*
+   Draw all roaches in batches.  All old positions are erased first, so a
+   roach erasing its old spot can no longer wipe out a neighbour that was
+   just drawn.  The roaches themselves go out as one glyph each.
+*/
+void DrawRoachesBatched()
+{
+    for (int rx = 0; rx < activeRoaches; rx++)
+    {
+        if (roaches.flags[rx] & ROACH_HIDDEN)
+        {
+            roaches.intX[rx] = -1;
+            continue;
         }
+
+        XClearArea(display,
+                   rootWin,
+                   roaches.intX[rx],
+                   roaches.intY[rx],
+                   (unsigned int) headingWidth[roaches.drawn[rx]],
+                   (unsigned int) headingHeight[roaches.drawn[rx]],
+                   False);
+
+        SettleRoach(rx);
+    }
+
+#if HAVE_XRENDER
+    CompositeRoaches(rootPicture);
+#endif
+}
+
+/*
+   Set up double buffering.  The back buffer holds what the root should
+   look like; rootBackground holds the root without any roaches, so old
+   roaches can be erased in the back buffer by copying from it.  Both
+   start out as a copy of the root.
+*/
+void InitDoubleBuffer()
+{
+    unsigned int depth;
+    XGCValues    xgcv;
+
+    depth = (unsigned int) DefaultDepth(display, screen);
+    backBuffer = XCreatePixmap(display, rootWin, display_width, display_height, depth);
+    rootBackground = XCreatePixmap(display, rootWin, display_width, display_height, depth);
+
+    xgcv.graphics_exposures = False;
+    copyGC = XCreateGC(display, rootWin, GCGraphicsExposures, &xgcv);
+
+    XCopyArea(display, rootWin, rootBackground, copyGC,
+              0, 0, display_width, display_height, 0, 0);
+    XCopyArea(display, rootWin, backBuffer, copyGC,
+              0, 0, display_width, display_height, 0, 0);
+
+    tilesX = (int) (display_width + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (int) (display_height + TILE_SIZE - 1) / TILE_SIZE;
+    dirtyTiles = (unsigned char *) calloc((size_t) (tilesX * tilesY), 1);
+
+#if HAVE_XRENDER
+    if (batchDraw)
+        backPicture = XRenderCreatePicture(display,
+                                           backBuffer,
+                                           XRenderFindVisualFormat(display,
+                                                                   DefaultVisual(display, screen)),
+                                           0,
+                                           NULL);
+#endif
+}
+
+/*
+   Mark the tiles under a rectangle as dirty.
+*/
+void DamageTiles(int x, int y, int width, int height)
+{
+    int tx1, ty1, tx2, ty2;
+
+    if (x < 0)
+    {
+        width += x;
+        x = 0;
+    }
+
+    if (y < 0)
+    {
+        height += y;
+        y = 0;
+    }
+
+    if (width <= 0 || height <= 0)
+        return;
+
+    tx1 = x / TILE_SIZE;
+    ty1 = y / TILE_SIZE;
+    tx2 = (x + width - 1) / TILE_SIZE;
+    ty2 = (y + height - 1) / TILE_SIZE;
+
+    if (tx2 >= tilesX)
+        tx2 = tilesX - 1;
+
+    if (ty2 >= tilesY)
+        ty2 = tilesY - 1;
+
+    for (int ty = ty1; ty <= ty2; ty++)
+        for (int tx = tx1; tx <= tx2; tx++)
+            dirtyTiles[ty * tilesX + tx] = 1;
+}
+
+/*
+   Copy the dirty tiles from one drawable to another.  Runs of dirty tiles
+   on a row go out as a single copy.
+*/
+void CopyDirtyTiles(Drawable from, Drawable to)
+{
+    int tx;
+    int run;
+
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        for (tx = 0; tx < tilesX; tx += run)
+        {
+            run = 1;
+
+            if (!dirtyTiles[ty * tilesX + tx])
+                continue;
+
+            while (tx + run < tilesX && dirtyTiles[ty * tilesX + tx + run])
+                run++;
+
+            XCopyArea(display, from, to, copyGC,
+                      tx * TILE_SIZE, ty * TILE_SIZE,
+                      (unsigned int) (run * TILE_SIZE), TILE_SIZE,
+                      tx * TILE_SIZE, ty * TILE_SIZE);
+        }
+    }
+}
+
+/*
+   Draw all roaches through the back buffer.  The tiles under the old and
+   new position of every roach are restored from the background, the
+   roaches are drawn into the back buffer, and only the dirty tiles are
+   copied to the root, once per frame.
+*/
+void DrawRoachesBuffered()
+{
+    for (int rx = 0; rx < activeRoaches; rx++)
+    {
+        if (roaches.intX[rx] >= 0)
+            DamageTiles(roaches.intX[rx], roaches.intY[rx],
+                        headingWidth[roaches.drawn[rx]], headingHeight[roaches.drawn[rx]]);
+
+        if (roaches.flags[rx] & ROACH_HIDDEN)
+        {
+            roaches.intX[rx] = -1;
+            continue;
+        }
+
+        SettleRoach(rx);
+        DamageTiles(roaches.intX[rx], roaches.intY[rx],
+                    headingWidth[roaches.drawn[rx]], headingHeight[roaches.drawn[rx]]);
+    }
+
+    CopyDirtyTiles(rootBackground, backBuffer);
+
+    if (batchDraw)
+    {
+#if HAVE_XRENDER
+        CompositeRoaches(backPicture);
+#endif
+    }
+    else
+    {
+        for (int rx = 0; rx < activeRoaches; rx++)
+            if (!(roaches.flags[rx] & ROACH_HIDDEN))
+                StippleRoach(backBuffer, rx);
+    }
+
+    CopyDirtyTiles(backBuffer, rootWin);
+    memset(dirtyTiles, 0, (size_t) (tilesX * tilesY));
+}
+
+/*
+   Part of the root has been exposed and repainted by the server, so take
+   a fresh copy of its background there.
+*/
+void RefreshBackground(XExposeEvent *expose)
+{
+    int bytesPerPixel;
+
+    if (shmDraw)
+    {
+        XGetSubImage(display, rootWin,
+                     expose->x, expose->y,
+                     (unsigned int) expose->width, (unsigned int) expose->height,
+                     AllPlanes, ZPixmap, frameImage, expose->x, expose->y);
+
+        bytesPerPixel = frameImage->bits_per_pixel / 8;
+
+        for (int y = expose->y; y < expose->y + expose->height; y++)
+            memcpy(frameBackground + y * frameImage->bytes_per_line + expose->x * bytesPerPixel,
+                   frameImage->data + y * frameImage->bytes_per_line + expose->x * bytesPerPixel,
+                   (size_t) (expose->width * bytesPerPixel));
+
+        return;
+    }
+
+    XCopyArea(display, rootWin, rootBackground, copyGC,
+              expose->x, expose->y,
+              (unsigned int) expose->width, (unsigned int) expose->height,
+              expose->x, expose->y);
+    XCopyArea(display, rootBackground, backBuffer, copyGC,
+              expose->x, expose->y,
+              (unsigned int) expose->width, (unsigned int) expose->height,
+              expose->x, expose->y);
+}
+
+/*
+   Set up software rendering.  The roaches are drawn by the client into an
+   image of the root, which lives in shared memory when the server supports
+   MIT-SHM and the connection is local, and is sent with XPutImage
+   otherwise.  frameBackground is a copy of the image without any roaches.
+   Returns False if the visual is not supported.
+*/
+Bool InitShmDraw(Pixel roachPixel)
+{
+    int          bytesPerLine;
+    int          rowBytes;
+    unsigned int depth;
+    Visual       *visual;
+    XGCValues    xgcv;
+    union {
+        int  word;
+        char byte;
+    } host;
+
+    visual = DefaultVisual(display, screen);
+    depth = (unsigned int) DefaultDepth(display, screen);
+    frameImage = NULL;
+
+#if HAVE_XSHM
+    if (XShmQueryExtension(display))
+    {
+        frameImage = XShmCreateImage(display, visual, depth, ZPixmap, NULL, &shmInfo,
+                                     display_width, display_height);
+    }
+
+    if (frameImage != NULL)
+    {
+        shmInfo.shmid = shmget(IPC_PRIVATE,
+                               (size_t) (frameImage->bytes_per_line * frameImage->height),
+                               IPC_CREAT | 0600);
+        shmInfo.shmaddr = frameImage->data = shmInfo.shmid < 0 ? (char *) -1 :
+                                             (char *) shmat(shmInfo.shmid, NULL, 0);
+        shmInfo.readOnly = False;
+
+        if (shmInfo.shmaddr != (char *) -1)
+        {
+            /*
+               Attaching fails on remote connections; that only shows up
+               as an error after a round trip.
+            */
+            XSetErrorHandler(RoachErrors);
+            errorVal = 0;
+            XShmAttach(display, &shmInfo);
+            XSync(display, False);
+            XSetErrorHandler((ErrorHandler *) NULL);
+
+            /* Mark the segment for removal once both sides detach. */
+            shmctl(shmInfo.shmid, IPC_RMID, NULL);
+            frameShared = !errorVal;
+
+            if (!frameShared)
+                shmdt(shmInfo.shmaddr);
+        }
+        else if (shmInfo.shmid >= 0)
+        {
+            shmctl(shmInfo.shmid, IPC_RMID, NULL);
+        }
+
+        if (!frameShared)
+        {
+            frameImage->data = NULL;
+            XDestroyImage(frameImage);
+            frameImage = NULL;
+        }
+    }
+#endif
+
+    if (frameImage == NULL)
+    {
+        frameImage = XCreateImage(display, visual, depth, ZPixmap, 0, NULL,
+                                  display_width, display_height, 32, 0);
+
+        if (frameImage == NULL)
+            return False;
+
+        frameImage->data = (char *) malloc((size_t) (frameImage->bytes_per_line * frameImage->height));
+    }
+
+    if (frameImage->bits_per_pixel % 8 != 0 || frameImage->bits_per_pixel > 64)
+        return False;
+
+    bytesPerLine = frameImage->bytes_per_line;
+    frameBackground = (char *) malloc((size_t) (bytesPerLine * frameImage->height));
+
+    XGetSubImage(display, rootWin, 0, 0, display_width, display_height,
+                 AllPlanes, ZPixmap, frameImage, 0, 0);
+    memcpy(frameBackground, frameImage->data, (size_t) (bytesPerLine * frameImage->height));
+
+    xgcv.graphics_exposures = False;
+    copyGC = XCreateGC(display, rootWin, GCGraphicsExposures, &xgcv);
+
+    nBands = (int) (display_height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+    bandMinX = (int *) malloc(sizeof(int) * nBands);
+    bandMaxX = (int *) malloc(sizeof(int) * nBands);
+
+    for (int bx = 0; bx < nBands; bx++)
+    {
+        bandMinX[bx] = (int) display_width;
+        bandMaxX[bx] = 0;
+    }
+
+    /*
+       Turn the XBM data into one word per sprite row, bit n being pixel
+       n, so a row can be skipped or walked a set bit at a time.
+    */
+    spriteRows = (unsigned long *) calloc((size_t) (ROACH_HEADINGS * 64), sizeof(unsigned long));
+
+    for (int hx = 0; hx < ROACH_HEADINGS; hx++)
+    {
+        if (roachPix[hx].width > 64 || roachPix[hx].height > 64 || sizeof(unsigned long) < 8)
+            return False;
+
+        rowBytes = (roachPix[hx].width + 7) / 8;
+
+        for (int y = 0; y < roachPix[hx].height; y++)
+            for (int bx = 0; bx < rowBytes; bx++)
+                spriteRows[hx * 64 + y] |=
+                    (unsigned long) (unsigned char) roachPix[hx].roachBits[y * rowBytes + bx] << (bx * 8);
+    }
+
+    framePixel = roachPixel;
+    host.word = 1;
+    frameNative = frameImage->byte_order == (host.byte ? LSBFirst : MSBFirst);
+
+    return True;
+}
+
+/*
+   Extend the damaged span of the bands under a rectangle.
+*/
+void DamageBands(int x, int y, int width, int height)
+{
+    int b1, b2;
+
+    if (x < 0)
+    {
+        width += x;
+        x = 0;
+    }
+
+    if (y < 0)
+    {
+        height += y;
+        y = 0;
+    }
+
+    if (x + width > (int) display_width)
+        width = (int) display_width - x;
+
+    if (y + height > (int) display_height)
+        height = (int) display_height - y;
+
+    if (width <= 0 || height <= 0)
+        return;
+
+    b1 = y / BAND_HEIGHT;
+    b2 = (y + height - 1) / BAND_HEIGHT;
+
+    for (int bx = b1; bx <= b2; bx++)
+    {
+        if (x < bandMinX[bx])
+            bandMinX[bx] = x;
+
+        if (x + width > bandMaxX[bx])
+            bandMaxX[bx] = x + width;
+    }
+}
+
+/*
+   Index of the lowest set bit of a non-zero word.
+*/
+static int LowestBit(unsigned long bits)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzl(bits);
+#else
+    int bx = 0;
+
+    while (!(bits & 1))
+    {
+        bits >>= 1;
+        bx++;
+    }
+
+    return bx;
+#endif
+}
+
+/*
+   Draw a roach into the frame image at its settled position, one sprite
+   row word at a time.  Pixels are stored directly when the image uses 32
+   bits per pixel in host byte order, and through XPutPixel otherwise.
+*/
+void BlitRoach(int rx)
+{
+    int           bx;
+    int           bytesPerPixel;
+    int           height;
+    int           width;
+    int           x;
+    int           y;
+    char          *row;
+    unsigned long bits;
+    unsigned long mask;
+
+    x = roaches.intX[rx];
+    y = roaches.intY[rx];
+    width = headingWidth[roaches.drawn[rx]];
+    height = headingHeight[roaches.drawn[rx]];
+    bytesPerPixel = frameImage->bits_per_pixel / 8;
+
+    if (x + width > (int) display_width)
+        width = (int) display_width - x;
+
+    if (y + height > (int) display_height)
+        height = (int) display_height - y;
+
+    if (x < 0 || y < 0 || width <= 0 || height <= 0)
+        return;
+
+    mask = width >= 64 ? ~0UL : (1UL << width) - 1;
+
+    for (int sy = 0; sy < height; sy++)
+    {
+        bits = spriteRows[roaches.drawn[rx] * 64 + sy] & mask;
+        row = frameImage->data + (y + sy) * frameImage->bytes_per_line + x * bytesPerPixel;
+
+        while (bits)
+        {
+            bx = LowestBit(bits);
+
+            if (frameNative && bytesPerPixel == 4)
+                ((unsigned int *) row)[bx] = (unsigned int) framePixel;
+            else
+                XPutPixel(frameImage, x + bx, y + sy, framePixel);
+
+            bits &= bits - 1;
+        }
+    }
+}
+
+/*
+   Restore the background under a roach at its old position.
+*/
+void EraseRoach(int rx)
+{
+    int bytesPerPixel;
+    int height;
+    int offset;
+    int width;
+    int x;
+    int y;
+
+    x = roaches.intX[rx];
+    y = roaches.intY[rx];
+    width = headingWidth[roaches.drawn[rx]];
+    height = headingHeight[roaches.drawn[rx]];
+    bytesPerPixel = frameImage->bits_per_pixel / 8;
+
+    if (x + width > (int) display_width)
+        width = (int) display_width - x;
+
+    if (y + height > (int) display_height)
+        height = (int) display_height - y;
+
+    if (x < 0 || y < 0 || width <= 0 || height <= 0)
+        return;
+
+    for (int sy = y; sy < y + height; sy++)
+    {
+        offset = sy * frameImage->bytes_per_line + x * bytesPerPixel;
+        memcpy(frameImage->data + offset, frameBackground + offset, (size_t) (width * bytesPerPixel));
+    }
+
+    DamageBands(x, y, width, height);
+}
+
+/*
+   Take a squished roach out of the frame image and leave its guts in the
+   background, so the next band pushed over the spot does not bring the
+   roach back or wipe out the guts.
+*/
+void SquishFrame(int rx)
+{
+    int  bytesPerPixel;
+    int  height;
+    int  offset;
+    int  rowBytes;
+    int  width;
+    int  x;
+    int  y;
+    char *data;
+
+    EraseRoach(rx);
+
+    x = roaches.intX[rx];
+    y = roaches.intY[rx];
+    width = squish_width;
+    height = squish_height;
+    bytesPerPixel = frameImage->bits_per_pixel / 8;
+    rowBytes = (squish_width + 7) / 8;
+
+    if (x + width > (int) display_width)
+        width = (int) display_width - x;
+
+    if (y + height > (int) display_height)
+        height = (int) display_height - y;
+
+    if (x < 0 || y < 0 || width <= 0 || height <= 0)
+        return;
+
+    /* Guts are rare, so XPutPixel straight into the background will do. */
+    data = frameImage->data;
+    frameImage->data = frameBackground;
+
+    for (int sy = 0; sy < height; sy++)
+        for (int sx = 0; sx < width; sx++)
+            if ((squish_bits[sy * rowBytes + sx / 8] >> (sx & 7)) & 1)
+                XPutPixel(frameImage, x + sx, y + sy, gutsPixel);
+
+    frameImage->data = data;
+
+    for (int sy = y; sy < y + height; sy++)
+    {
+        offset = sy * frameImage->bytes_per_line + x * bytesPerPixel;
+        memcpy(frameImage->data + offset, frameBackground + offset, (size_t) (width * bytesPerPixel));
+    }
+
+    DamageBands(x, y, width, height);
+}
+
+/*
+   Draw all roaches in software.  Old positions are restored from the
+   background, the roaches are blitted into the frame image, and every
+   damaged band goes to the root as one image request.
+*/
+void DrawRoachesShm()
+{
+    int height;
+
+#if HAVE_XSHM
+    /* The server may still be reading the last frame out of the segment. */
+    if (frameShared)
+    {
+        ProfilePart(PROFILE_SYNC);
+        XSync(display, False);
+        ProfilePart(PROFILE_DRAW);
+    }
+#endif
+
+    for (int rx = 0; rx < activeRoaches; rx++)
+    {
+        EraseRoach(rx);
+
+        if (roaches.flags[rx] & ROACH_HIDDEN)
+            roaches.intX[rx] = -1;
+        else
+            SettleRoach(rx);
+    }
+
+    for (int rx = 0; rx < activeRoaches; rx++)
+    {
+        if (roaches.flags[rx] & ROACH_HIDDEN)
+            continue;
+
+        BlitRoach(rx);
+        DamageBands(roaches.intX[rx], roaches.intY[rx],
+                    headingWidth[roaches.drawn[rx]], headingHeight[roaches.drawn[rx]]);
+    }
+
+    for (int bx = 0; bx < nBands; bx++)
+    {
+        if (bandMinX[bx] >= bandMaxX[bx])
+            continue;
+
+        height = BAND_HEIGHT;
+
+        if ((bx + 1) * BAND_HEIGHT > (int) display_height)
+            height = (int) display_height - bx * BAND_HEIGHT;
+
+#if HAVE_XSHM
+        if (frameShared)
+            XShmPutImage(display, rootWin, copyGC, frameImage,
+                         bandMinX[bx], bx * BAND_HEIGHT,
+                         bandMinX[bx], bx * BAND_HEIGHT,
+                         (unsigned int) (bandMaxX[bx] - bandMinX[bx]), (unsigned int) height,
+                         False);
+        else
+#endif
+            XPutImage(display, rootWin, copyGC, frameImage,
+                      bandMinX[bx], bx * BAND_HEIGHT,
+                      bandMinX[bx], bx * BAND_HEIGHT,
+                      (unsigned int) (bandMaxX[bx] - bandMinX[bx]), (unsigned int) height);
+
+        bandMinX[bx] = (int) display_width;
+        bandMaxX[bx] = 0;
     }
 }
 
@@ -658,36 +1893,29 @@ void CoverRoot()
     XFlush(display);
 }
 
-#if !GRAB_SERVER
 int RoachErrors(Display *display, XErrorEvent *err)
 {
     errorVal = err->error_code;
 
     return 0;
 }
-#endif /* GRAB_SERVER */
 
 /*
-   Calculate visible region of root window.
+   Record every child of the root in the window cache, one window at a
+   time.  Events that arrive during the scan are applied afterwards and
+   bring the cache up to date.
 */
-int CalcRootVisible()
+void ScanWindows()
 {
-    int               winX, winY;
-    Region            covered;
-    Region            visible;
-    unsigned int      borderWidth;
-    unsigned int      depth;
     unsigned int      nChildren;
-    unsigned int      winHeight, winWidth;
     Window            *children;
     Window            dummy;
-    XRectangle        rect;
     XWindowAttributes wa;
 
     /*
-       If we don't grab the server, the XGetWindowAttribute or XGetGeometry
-       calls can abort us.  On the other hand, the server grabs can make for
-       some annoying delays.
+       If we don't grab the server, the XGetWindowAttribute calls can
+       abort us.  On the other hand, the server grabs can make for some
+       annoying delays.
     */
 #if GRAB_SERVER
     XGrabServer(display);
@@ -700,44 +1928,22 @@ int CalcRootVisible()
     */
     XQueryTree(display, rootWin, &dummy, &dummy, &children, &nChildren);
 
-    /*
-       For each mapped child, add the window rectangle to the covered
-       region.
-    */
-    covered = XCreateRegion();
+    TraceEvent(TRACE_SCAN, None, 0, 0, 0, 0, 0, 0, 0);
 
     for (int wx = 0; wx < nChildren; wx++)
     {
-        if (XEventsQueued(display, QueuedAlready))
-        {
-            XDestroyRegion(covered);
-            return 1;
-        }
-
         errorVal = 0;
         XGetWindowAttributes(display, children[wx], &wa);
 
         if (errorVal)
             continue;
 
-        if (wa.class == InputOutput && wa.map_state == IsViewable)
-        {
-            XGetGeometry(display, children[wx], &dummy,
-                         &winX, &winY,
-                         &winWidth, &winHeight,
-                         &borderWidth, &depth);
-
-            if (errorVal)
-                continue;
-
-            rect.x = (short) winX;
-            rect.y = (short) winY;
-
-            rect.width = (unsigned short) (winWidth + (borderWidth * 2));
-            rect.height = (unsigned short) (winHeight + (borderWidth * 2));
-
-            XUnionRectWithRegion(&rect, covered, covered);
-        }
+        TraceEvent(TRACE_WINDOW, children[wx],
+                   wa.x, wa.y,
+                   wa.width, wa.height,
+                   wa.border_width,
+                   wa.map_state == IsViewable,
+                   wa.class == InputOutput ? WINDOW_INPUT_OUTPUT : WINDOW_INPUT_ONLY);
     }
 
     XFree(children);
@@ -747,67 +1953,147 @@ int CalcRootVisible()
 #else
     XSetErrorHandler((ErrorHandler *) NULL);
 #endif
+}
 
-    /*
-       Subtract the covered region from the root window region.
-    */
-    visible = XCreateRegion();
+#if HAVE_XCB
+/*
+   Same as ScanWindows, but on the XCB connection: the attribute and
+   geometry requests for all children are sent before the first reply is
+   read, so the whole scan costs about two round trips however many windows
+   there are.  A window destroyed in the meantime just comes back as an
+   error for its own reply.
+*/
+void ScanWindowsXcb()
+{
+    int                                 nChildren;
+    xcb_window_t                        *children;
+    xcb_generic_error_t                 *error;
+    xcb_get_geometry_reply_t            *geometry;
+    xcb_get_window_attributes_reply_t   *attributes;
+    xcb_query_tree_reply_t              *tree;
 
-    rect.x = 0;
-    rect.y = 0;
+#if GRAB_SERVER
+    xcb_grab_server(xconn);
+#endif
 
-    rect.width  = (unsigned short) display_width;
-    rect.height = (unsigned short) display_height;
+    tree = xcb_query_tree_reply(xconn, xcb_query_tree(xconn, (xcb_window_t) rootWin), NULL);
+    ProfileCount(X_QueryTree, 1, 8, 1, 1);
+    TraceEvent(TRACE_SCAN, None, 0, 0, 0, 0, 0, 0, 0);
 
-    XUnionRectWithRegion(&rect, visible, visible);
-    XSubtractRegion(visible, covered, visible);
-    XDestroyRegion(covered);
+    if (tree == NULL)
+    {
+#if GRAB_SERVER
+        xcb_ungrab_server(xconn);
+        xcb_flush(xconn);
+#endif
+        return;
+    }
 
-    /*
-       Save visible region globally.
-    */
-    if (rootVisible)
-        XDestroyRegion(rootVisible);
+    children = xcb_query_tree_children(tree);
+    nChildren = xcb_query_tree_children_length(tree);
 
-    rootVisible = visible;
+    if (nChildren > maxScanCookies)
+    {
+        free(attributeCookies);
+        free(geometryCookies);
+        maxScanCookies = nChildren;
+        attributeCookies = (xcb_get_window_attributes_cookie_t *)
+            malloc(sizeof(xcb_get_window_attributes_cookie_t) * maxScanCookies);
+        geometryCookies = (xcb_get_geometry_cookie_t *)
+            malloc(sizeof(xcb_get_geometry_cookie_t) * maxScanCookies);
+    }
 
-    /*
-       Mark all roaches visible.
-    */
-    for (int wx = 0; wx < curRoaches; wx++)
-        roaches[wx].hidden = 0;
+    for (int wx = 0; wx < nChildren; wx++)
+    {
+        attributeCookies[wx] = xcb_get_window_attributes(xconn, children[wx]);
+        geometryCookies[wx] = xcb_get_geometry(xconn, children[wx]);
+    }
+
+#if GRAB_SERVER
+    xcb_ungrab_server(xconn);
+#endif
+    xcb_flush(xconn);
+
+    /* The scan goes around Xlib, so count it here: one wait for the lot. */
+    ProfileCount(X_GetWindowAttributes, (unsigned long) nChildren, 8UL * nChildren, 1, 1);
+    ProfileCount(X_GetGeometry, (unsigned long) nChildren, 8UL * nChildren, 0, 0);
+
+    for (int wx = 0; wx < nChildren; wx++)
+    {
+        attributes = xcb_get_window_attributes_reply(xconn, attributeCookies[wx], &error);
+        free(error);
+        geometry = xcb_get_geometry_reply(xconn, geometryCookies[wx], &error);
+        free(error);
+
+        if (attributes != NULL && geometry != NULL)
+        {
+            TraceEvent(TRACE_WINDOW, children[wx],
+                       geometry->x, geometry->y,
+                       geometry->width, geometry->height,
+                       geometry->border_width,
+                       attributes->map_state == XCB_MAP_STATE_VIEWABLE,
+                       attributes->_class == XCB_WINDOW_CLASS_INPUT_OUTPUT ?
+                       WINDOW_INPUT_OUTPUT : WINDOW_INPUT_ONLY);
+        }
+
+        free(attributes);
+        free(geometry);
+    }
+
+    free(tree);
+}
+#endif /* HAVE_XCB */
+
+/*
+   Calculate visible region of root window from a full scan of its
+   children.
+*/
+int CalcRootVisible()
+{
+    double start;
+    int    part;
+
+    start = NowUsec();
+    part = ProfilePart(PROFILE_CALC);
+
+#if HAVE_XCB
+    if (xconn != NULL)
+        ScanWindowsXcb();
+    else
+#endif
+        ScanWindows();
+
+    TraceEvent(TRACE_RESET, None, 0, 0, 0, 0, 0, 0, 0);
+    ProfilePart(part);
+    stats.calcCalls++;
+    stats.calcUsec += NowUsec() - start;
 
     return 0;
 }
 
 /*
-   Mark hidden roaches.
+   Find out whether a window that was created after the last scan is an
+   InputOutput window, once it gets mapped.
 */
-int MarkHiddenRoaches()
+int FetchWindowKind(Window id)
 {
-    int   nVisible;
-    Roach *r;
+    int               kind;
+    XWindowAttributes wa;
 
-    nVisible = 0;
+    kind = WindowKind(id);
 
-    for (int rx = 0; rx < curRoaches; rx++)
-    {
-        r = &roaches[rx];
+    if (kind != WINDOW_UNKNOWN)
+        return kind;
 
-        if (!r->hidden)
-        {
-            if (r->intX > 0 && XRectInRegion(rootVisible,
-                                             r->intX,
-                                             r->intY,
-                                             (unsigned int) r->rp->width,
-                                             (unsigned int) r->rp->height) == RectangleOut)
-                r->hidden = 1;
-            else
-                nVisible++;
-        }
-    }
+    XSetErrorHandler(RoachErrors);
+    errorVal = 0;
+    XGetWindowAttributes(display, id, &wa);
+    XSetErrorHandler((ErrorHandler *) NULL);
+
+    if (errorVal)
+        return WINDOW_INPUT_ONLY;
 
-    return nVisible;
+    return wa.class == InputOutput ? WINDOW_INPUT_OUTPUT : WINDOW_INPUT_ONLY;
 }
 
 /*
@@ -836,39 +2122,41 @@ Pixel AllocNamedColor(char *colorName, Pixel dfltPix)
  */
 void checkSquish(XButtonEvent *buttonEvent)
 {
-    int   x;
-    int   y;
-    Roach *r;
+    int hits[SQUISH_HITS];
+    int nHits;
+    int rx;
+    int ry;
+    int part;
 
-    x = buttonEvent->x;
-    y = buttonEvent->y;
+    TraceSquish(buttonEvent->x, buttonEvent->y);
+    part = ProfilePart(PROFILE_SQUISH);
 
-    for (int rx = 0; rx < curRoaches; rx++)
+    do
     {
-        r = &roaches[rx];
-
-        if (r->rp == NULL)
-            continue;
+        nHits = RoachesAt(buttonEvent->x, buttonEvent->y, exactSquish, hits, SQUISH_HITS);
 
-        if (x > r->intX && x < (r->intX + r->rp->width) && y > r->intY && y < (r->intY + r->rp->height))
+        for (int hx = 0; hx < nHits; hx++)
         {
-            XSetStipple(display, gutsGC, squishMap);
-            XSetTSOrigin(display, gutsGC, r->intX, r->intY);
+            rx = roaches.intX[hits[hx]];
+            ry = roaches.intY[hits[hx]];
+
+            if (shmDraw)
+                SquishFrame(hits[hx]);
+
+            XSetTSOrigin(display, gutsGC, rx - squishAtlasX, ry);
             XFillRectangle(display,
                            rootWin,
                            gutsGC,
-                           r->intX,
-                           r->intY,
+                           rx,
+                           ry,
                            squish_width,
                            squish_height);
             /*
             * Delete the roach
             */
-            for (int i = rx; i < curRoaches - 1; i++)
-                roaches[i] = roaches[i + 1];
-
-            curRoaches--;
-            rx--;
+            RemoveRoach(hits[hx]);
         }
-    }
+    } while (nHits == SQUISH_HITS);
+
+    ProfilePart(part);
 }